@@ -0,0 +1,685 @@
+/* Microbenchmarks of the queue operations, run by the bench command */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "console.h"
+#include "random.h"
+#include "report.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+
+/* Default number of elements */
+#define BENCH_SIZE 10000
+
+/* Longest string generated */
+#define BENCH_MAX_LEN 1024
+
+/* Results kept for save and compare */
+#define BENCH_MAX_RESULTS 256
+
+/* Group size of reverseK */
+#define BENCH_K 4
+
+/* How the strings are ordered before insertion */
+enum { INPUT_RANDOM, INPUT_SORTED, INPUT_REVERSED };
+static const char *const input_names[] = {"random", "sorted", "reversed"};
+
+static int bench_reps = 10;
+static int bench_warmup = 2;
+static int bench_len = 8;
+static int bench_input = INPUT_RANDOM;
+static int bench_tolerance = 10;
+
+static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+
+typedef struct {
+    const char *name;
+    struct list_head *(*create)();
+} bench_kind_t;
+
+static const bench_kind_t kinds[] = {
+    {"list", q_new},
+    {"ring", q_new_ring},
+    {"unrolled", q_new_unrolled},
+};
+
+/* State of one benchmark run */
+typedef struct {
+    const bench_kind_t *kind;
+    int n;
+    char *text;     /* Characters of all strings */
+    char **strings; /* Input, in the order set by option input */
+    char **moved;   /* Copies handed over by ihm and itm */
+    struct list_head *q;
+    queue_contex_t ctx[2]; /* The two queues merged by merge */
+    struct list_head chain;
+    struct list_head out; /* Elements removed by rh, rt, rhb and rtb */
+} bench_t;
+
+/* What the queue holds before an operation is timed */
+enum {
+    SETUP_EMPTY,  /* Nothing */
+    SETUP_FILLED, /* All strings, in input order */
+    SETUP_SORTED, /* All strings, sorted */
+    SETUP_MOVED,  /* Nothing, with copies of the strings to hand over */
+    SETUP_SPLIT,  /* Two sorted queues in a chain, half the strings each */
+};
+
+typedef struct {
+    const char *name;
+    int setup;
+    bool per_element; /* Whether each element counts as one operation */
+    bool (*run)(bench_t *b);
+} bench_op_t;
+
+typedef struct {
+    const char *op;
+    const char *kind;
+    int size;
+    int len;
+    int input;
+    double ns_per_op;
+    double spread; /* Standard deviation, in percent of the mean */
+    double elements_per_sec;
+} bench_result_t;
+
+static bench_result_t results[BENCH_MAX_RESULTS];
+static int nresults = 0;
+
+static bool run_ih(bench_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        if (!q_insert_head(b->q, b->strings[i]))
+            return false;
+    }
+    return true;
+}
+
+static bool run_it(bench_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        if (!q_insert_tail(b->q, b->strings[i]))
+            return false;
+    }
+    return true;
+}
+
+/* Strings handed over are cleared, the others stay for bench_cleanup() */
+static bool run_moved(bench_t *b, bool (*insert)(struct list_head *, char *))
+{
+    for (int i = 0; i < b->n; i++) {
+        if (!insert(b->q, b->moved[i]))
+            return false;
+        b->moved[i] = NULL;
+    }
+    return true;
+}
+
+static bool run_ihm(bench_t *b)
+{
+    return run_moved(b, q_insert_head_move);
+}
+
+static bool run_itm(bench_t *b)
+{
+    return run_moved(b, q_insert_tail_move);
+}
+
+static bool run_ihb(bench_t *b)
+{
+    return q_insert_bulk(b->q, b->strings, b->n, false);
+}
+
+static bool run_itb(bench_t *b)
+{
+    return q_insert_bulk(b->q, b->strings, b->n, true);
+}
+
+static bool run_rh(bench_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        element_t *e = q_remove_head(b->q, NULL, 0);
+        if (!e)
+            return false;
+        list_add_tail(&e->list, &b->out);
+    }
+    return true;
+}
+
+static bool run_rt(bench_t *b)
+{
+    for (int i = 0; i < b->n; i++) {
+        element_t *e = q_remove_tail(b->q, NULL, 0);
+        if (!e)
+            return false;
+        list_add_tail(&e->list, &b->out);
+    }
+    return true;
+}
+
+static bool run_rhb(bench_t *b)
+{
+    return q_remove_bulk(b->q, &b->out, b->n, false, NULL, 0) == b->n;
+}
+
+static bool run_rtb(bench_t *b)
+{
+    return q_remove_bulk(b->q, &b->out, b->n, true, NULL, 0) == b->n;
+}
+
+static bool run_size(bench_t *b)
+{
+    bool ok = true;
+    for (int i = 0; i < b->n; i++)
+        ok &= q_size(b->q) == b->n;
+    return ok;
+}
+
+static bool run_dm(bench_t *b)
+{
+    return q_delete_mid(b->q);
+}
+
+static bool run_dedup(bench_t *b)
+{
+    return q_delete_dup(b->q);
+}
+
+static bool run_dedup_all(bench_t *b)
+{
+    return q_delete_dup_all(b->q);
+}
+
+static bool run_swap(bench_t *b)
+{
+    q_swap(b->q);
+    return true;
+}
+
+static bool run_reverse(bench_t *b)
+{
+    q_reverse(b->q);
+    return true;
+}
+
+static bool run_reverseK(bench_t *b)
+{
+    q_reverseK(b->q, BENCH_K);
+    return true;
+}
+
+static bool run_sort(bench_t *b)
+{
+    q_sort(b->q, false);
+    return true;
+}
+
+static bool run_ascend(bench_t *b)
+{
+    return q_ascend(b->q) > 0;
+}
+
+static bool run_descend(bench_t *b)
+{
+    return q_descend(b->q) > 0;
+}
+
+static bool run_merge(bench_t *b)
+{
+    return q_merge(&b->chain, false) == b->n;
+}
+
+static bool run_shuffle(bench_t *b)
+{
+    return q_shuffle(b->q);
+}
+
+static bool run_free(bench_t *b)
+{
+    q_free(b->q);
+    b->q = NULL;
+    return true;
+}
+
+static const bench_op_t ops[] = {
+    {"ih", SETUP_EMPTY, true, run_ih},
+    {"it", SETUP_EMPTY, true, run_it},
+    {"ihm", SETUP_MOVED, true, run_ihm},
+    {"itm", SETUP_MOVED, true, run_itm},
+    {"ihb", SETUP_EMPTY, true, run_ihb},
+    {"itb", SETUP_EMPTY, true, run_itb},
+    {"rh", SETUP_FILLED, true, run_rh},
+    {"rt", SETUP_FILLED, true, run_rt},
+    {"rhb", SETUP_FILLED, true, run_rhb},
+    {"rtb", SETUP_FILLED, true, run_rtb},
+    {"size", SETUP_FILLED, true, run_size},
+    {"dm", SETUP_FILLED, false, run_dm},
+    {"dedup", SETUP_SORTED, false, run_dedup},
+    {"dedup_all", SETUP_SORTED, false, run_dedup_all},
+    {"swap", SETUP_FILLED, false, run_swap},
+    {"reverse", SETUP_FILLED, false, run_reverse},
+    {"reverseK", SETUP_FILLED, false, run_reverseK},
+    {"sort", SETUP_FILLED, false, run_sort},
+    {"ascend", SETUP_FILLED, false, run_ascend},
+    {"descend", SETUP_FILLED, false, run_descend},
+    {"merge", SETUP_SPLIT, false, run_merge},
+    {"shuffle", SETUP_FILLED, false, run_shuffle},
+    {"free", SETUP_FILLED, false, run_free},
+};
+
+#define NOPS (sizeof(ops) / sizeof(ops[0]))
+#define NKINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_string(const void *a, const void *b)
+{
+    return q_compare(*(char *const *) a, *(char *const *) b);
+}
+
+/* Generate n strings of bench_len characters, ordered as set by input */
+static void make_strings(bench_t *b)
+{
+    int n = b->n;
+    size_t len = bench_len;
+    char **strings = calloc_or_fail(n, sizeof(char *), "make_strings");
+    char *text = malloc_or_fail(n * (len + 1), "make_strings");
+
+    randombytes((uint8_t *) text, n * (len + 1));
+    for (int i = 0; i < n; i++) {
+        char *s = text + i * (len + 1);
+        for (size_t j = 0; j < len; j++)
+            s[j] = charset[(uint8_t) s[j] % (sizeof(charset) - 1)];
+        s[len] = '\0';
+        strings[i] = s;
+    }
+
+    if (bench_input != INPUT_RANDOM)
+        qsort(strings, n, sizeof(char *), cmp_string);
+    if (bench_input == INPUT_REVERSED) {
+        for (int i = 0, j = n - 1; i < j; i++, j--) {
+            char *s = strings[i];
+            strings[i] = strings[j];
+            strings[j] = s;
+        }
+    }
+    b->text = text;
+    b->strings = strings;
+}
+
+static void free_strings(bench_t *b)
+{
+    free_block(b->text, b->n * ((size_t) bench_len + 1));
+    free_array(b->strings, b->n, sizeof(char *));
+}
+
+static struct list_head *make_queue(bench_t *b, char **strings, int n,
+                                    bool sorted)
+{
+    struct list_head *q = b->kind->create();
+    if (!q)
+        return NULL;
+
+    if (n && !q_insert_bulk(q, strings, n, true)) {
+        q_free(q);
+        return NULL;
+    }
+    if (sorted)
+        q_sort(q, false);
+    return q;
+}
+
+static bool bench_setup(bench_t *b, const bench_op_t *op)
+{
+    INIT_LIST_HEAD(&b->out);
+    if (op->setup == SETUP_SPLIT) {
+        int half = b->n / 2;
+        INIT_LIST_HEAD(&b->chain);
+        b->ctx[0].q = make_queue(b, b->strings, half, true);
+        b->ctx[1].q = make_queue(b, b->strings + half, b->n - half, true);
+        for (int i = 0; i < 2; i++) {
+            b->ctx[i].size = q_size(b->ctx[i].q);
+            b->ctx[i].id = i;
+            list_add_tail(&b->ctx[i].chain, &b->chain);
+        }
+        return b->ctx[0].q && b->ctx[1].q;
+    }
+
+    bool fill = op->setup == SETUP_FILLED || op->setup == SETUP_SORTED;
+    b->q = make_queue(b, b->strings, fill ? b->n : 0,
+                      op->setup == SETUP_SORTED);
+    if (op->setup == SETUP_MOVED) {
+        for (int i = 0; i < b->n; i++) {
+            b->moved[i] = test_strdup(b->strings[i]);
+            if (!b->moved[i])
+                return false;
+        }
+    }
+    return b->q;
+}
+
+static void bench_cleanup(bench_t *b, const bench_op_t *op)
+{
+    if (op->setup == SETUP_SPLIT) {
+        q_free(b->ctx[0].q);
+        q_free(b->ctx[1].q);
+    }
+    q_free(b->q);
+    b->q = NULL;
+
+    for (int i = 0; op->setup == SETUP_MOVED && i < b->n; i++) {
+        if (b->moved[i])
+            test_free(b->moved[i]);
+        b->moved[i] = NULL;
+    }
+
+    element_t *e, *safe;
+    list_for_each_entry_safe(e, safe, &b->out, list)
+        q_release_element(e);
+}
+
+/* Time op over the warmup and measured runs, recording the result */
+static bool bench_op(bench_t *b, const bench_op_t *op)
+{
+    double sum = 0, sum_sq = 0;
+
+    for (int rep = -bench_warmup; rep < bench_reps; rep++) {
+        if (!bench_setup(b, op)) {
+            bench_cleanup(b, op);
+            report(1, "ERROR: Could not set up benchmark of %s", op->name);
+            return false;
+        }
+
+        bool ok = false;
+        int64_t elapsed = 0;
+        if (exception_setup(false)) {
+            elapsed = now_ns();
+            ok = op->run(b);
+            elapsed = now_ns() - elapsed;
+        }
+        exception_cancel();
+
+        bench_cleanup(b, op);
+        if (error_check())
+            return false;
+        if (!ok) {
+            report(1, "ERROR: %s failed on %s queue of %d elements", op->name,
+                   b->kind->name, b->n);
+            return false;
+        }
+
+        if (rep >= 0) {
+            sum += elapsed;
+            sum_sq += (double) elapsed * elapsed;
+        }
+    }
+
+    double mean = sum / bench_reps;
+    double var = bench_reps > 1
+                     ? (sum_sq - sum * mean) / (bench_reps - 1)
+                     : 0;
+    bench_result_t r = {
+        .op = op->name,
+        .kind = b->kind->name,
+        .size = b->n,
+        .len = bench_len,
+        .input = bench_input,
+        .ns_per_op = mean / (op->per_element ? b->n : 1),
+        .spread = mean > 0 && var > 0 ? 100 * sqrt(var) / mean : 0,
+        .elements_per_sec = mean > 0 ? b->n * 1e9 / mean : 0,
+    };
+    report(1, "%-9s %-8s %8d %4d %-8s %12.1f %6.1f %12.0f", r.op, r.kind,
+           r.size, r.len, input_names[r.input], r.ns_per_op, r.spread,
+           r.elements_per_sec);
+
+    if (nresults == BENCH_MAX_RESULTS) {
+        report(1, "Warning: Result of %s not kept, use 'bench reset'",
+               op->name);
+        return true;
+    }
+    results[nresults++] = r;
+    return true;
+}
+
+static bool bench_run(const char *name, int n, const bench_kind_t *kind)
+{
+    bool all = !strcmp(name, "all");
+    const bench_op_t *op = NULL;
+    for (size_t i = 0; i < NOPS && !all && !op; i++) {
+        if (!strcmp(name, ops[i].name))
+            op = &ops[i];
+    }
+    if (!all && !op) {
+        report(1, "Unknown operation '%s'", name);
+        return false;
+    }
+
+    bench_t b = {
+        .kind = kind,
+        .n = n,
+        .moved = calloc_or_fail(n, sizeof(char *), "bench_run"),
+    };
+    make_strings(&b);
+
+    /* Benchmarks measure the queue, not the injected failures */
+    int saved_fail_probability = fail_probability;
+    fail_probability = 0;
+
+    report(1, "%-9s %-8s %8s %4s %-8s %12s %6s %12s", "op", "queue", "size",
+           "len", "input", "ns/op", "+-%", "elements/s");
+    bool ok = true;
+    for (size_t i = 0; i < NOPS && ok; i++) {
+        if (all || op == &ops[i])
+            ok = bench_op(&b, &ops[i]);
+    }
+
+    fail_probability = saved_fail_probability;
+    free_array(b.moved, n, sizeof(char *));
+    free_strings(&b);
+    return ok;
+}
+
+static bool bench_save(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        report(1, "Couldn't open baseline file '%s'", filename);
+        return false;
+    }
+
+    fprintf(f, "# op queue size len input ns/op +-%% elements/s\n");
+    for (int i = 0; i < nresults; i++) {
+        const bench_result_t *r = &results[i];
+        fprintf(f, "%s %s %d %d %s %.3f %.3f %.0f\n", r->op, r->kind, r->size,
+                r->len, input_names[r->input], r->ns_per_op, r->spread,
+                r->elements_per_sec);
+    }
+
+    if (fclose(f)) {
+        report(1, "Couldn't write baseline file '%s'", filename);
+        return false;
+    }
+    return true;
+}
+
+static const bench_result_t *find_result(const char *op, const char *kind,
+                                         int size, int len, const char *input)
+{
+    for (int i = 0; i < nresults; i++) {
+        const bench_result_t *r = &results[i];
+        if (!strcmp(r->op, op) && !strcmp(r->kind, kind) && r->size == size &&
+            r->len == len && !strcmp(input_names[r->input], input))
+            return r;
+    }
+    return NULL;
+}
+
+/* Compare the results with those in a baseline file.  A result more than
+ * option tolerance percent slower than its baseline is a regression
+ */
+static bool bench_compare(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        report(1, "Couldn't open baseline file '%s'", filename);
+        return false;
+    }
+
+    char line[256];
+    int matched = 0, regressed = 0;
+    report(1, "%-9s %-8s %8s %4s %-8s %12s %12s %8s", "op", "queue", "size",
+           "len", "input", "base ns/op", "ns/op", "change");
+    while (fgets(line, sizeof(line), f)) {
+        char op[32], kind[32], input[32];
+        int size, len;
+        double base;
+        if (line[0] == '#' ||
+            sscanf(line, "%31s %31s %d %d %31s %lf", op, kind, &size, &len,
+                   input, &base) != 6)
+            continue;
+
+        const bench_result_t *r = find_result(op, kind, size, len, input);
+        if (!r || base <= 0)
+            continue;
+
+        double change = 100 * (r->ns_per_op - base) / base;
+        bool worse = change > bench_tolerance;
+        report(1, "%-9s %-8s %8d %4d %-8s %12.1f %12.1f %+7.1f%%%s", op,
+               kind, size, len, input, base, r->ns_per_op, change,
+               worse ? "  REGRESSED" : "");
+        matched++;
+        regressed += worse;
+    }
+    fclose(f);
+
+    if (!matched) {
+        report(1, "No results match baseline file '%s'", filename);
+        return false;
+    }
+    if (regressed) {
+        report(1, "ERROR: %d of %d results regressed by more than %d%%",
+               regressed, matched, bench_tolerance);
+        return false;
+    }
+    return true;
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        nresults = 0;
+        return true;
+    }
+
+    if (argc >= 2 &&
+        (!strcmp(argv[1], "save") || !strcmp(argv[1], "compare"))) {
+        if (argc != 3) {
+            report(1, "%s %s takes a file name", argv[0], argv[1]);
+            return false;
+        }
+        return argv[1][0] == 's' ? bench_save(argv[2])
+                                 : bench_compare(argv[2]);
+    }
+
+    if (argc > 4) {
+        report(1, "%s takes at most three arguments", argv[0]);
+        return false;
+    }
+
+    int n = BENCH_SIZE;
+    if (argc > 2 && (!get_int(argv[2], &n) || n < 1)) {
+        report(1, "Invalid number of elements '%s'", argv[2]);
+        return false;
+    }
+
+    const bench_kind_t *kind = &kinds[0];
+    if (argc > 3) {
+        for (kind = kinds; kind < kinds + NKINDS; kind++) {
+            if (!strcmp(argv[3], kind->name))
+                break;
+        }
+        if (kind == kinds + NKINDS) {
+            report(1, "Unknown queue kind '%s'", argv[3]);
+            return false;
+        }
+    }
+
+    return bench_run(argc > 1 ? argv[1] : "all", n, kind);
+}
+
+static void set_reps(int oldval)
+{
+    if (bench_reps < 1) {
+        report(1, "ERROR: Repetitions must be at least 1");
+        bench_reps = oldval;
+    }
+}
+
+static void set_warmup(int oldval)
+{
+    if (bench_warmup < 0) {
+        report(1, "ERROR: Warmup runs must not be negative");
+        bench_warmup = oldval;
+    }
+}
+
+static void set_len(int oldval)
+{
+    if (bench_len < 1 || bench_len > BENCH_MAX_LEN) {
+        report(1, "ERROR: String length must be between 1 and %d",
+               BENCH_MAX_LEN);
+        bench_len = oldval;
+    }
+}
+
+static void set_input(int oldval)
+{
+    if (bench_input < INPUT_RANDOM || bench_input > INPUT_REVERSED) {
+        report(1, "ERROR: Input must be between %d and %d", INPUT_RANDOM,
+               INPUT_REVERSED);
+        bench_input = oldval;
+    }
+}
+
+static void set_tolerance(int oldval)
+{
+    if (bench_tolerance < 0) {
+        report(1, "ERROR: Tolerance must not be negative");
+        bench_tolerance = oldval;
+    }
+}
+
+void bench_init()
+{
+    ADD_COMMAND(bench,
+                "Time queue operation op (default: all) on n elements "
+                "(default: 10000) of a list, ring or unrolled queue; save or "
+                "compare the results with a baseline file, or reset them",
+                "[op|all] [n] [kind] | save FILE | compare FILE | reset");
+    add_param("reps", &bench_reps, "Measured runs of each benchmark",
+              set_reps);
+    add_param("warmup", &bench_warmup, "Unmeasured runs before benchmarks",
+              set_warmup);
+    add_param("strlen", &bench_len, "Length of benchmark strings", set_len);
+    add_param("input", &bench_input,
+              "Benchmark input (0: random, 1: sorted, 2: reversed)",
+              set_input);
+    add_param("tolerance", &bench_tolerance,
+              "Percent slowdown over baseline reported as a regression",
+              set_tolerance);
+}
@@ -0,0 +1,15 @@
+#ifndef LAB0_BENCH_H
+#define LAB0_BENCH_H
+
+/* Microbenchmarks of the queue operations.
+ *
+ * The bench command times each operation of queue.h on queues built from
+ * generated strings, after a few warmup runs, and reports ns/op, elements/s
+ * and the spread between runs.  Results can be saved to a baseline file and
+ * later compared against it to catch regressions.
+ */
+
+/* Register the bench command and its options with the console */
+void bench_init();
+
+#endif /* LAB0_BENCH_H */
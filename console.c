@@ -7,11 +7,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "dudect/cpucycles.h"
 #include "report.h"
 #include "web.h"
 
@@ -20,6 +23,25 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are also found by name through open-addressed
+ * hash tables with linear probing, kept at most half full.  The sorted
+ * lists above stay for help, option and completion.
+ */
+typedef struct {
+    const char *name;
+    void *entry;
+} name_slot_t;
+
+typedef struct {
+    name_slot_t *slots;
+    size_t capacity; /* Power of 2, or 0 before the first entry */
+    size_t count;
+} name_table_t;
+
+#define NAME_TABLE_MIN 32
+
+static name_table_t cmd_table, param_table;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -56,6 +78,29 @@ static int echo = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
+
+/* Per-command statistics.
+ * With option profile set, every command is timed in cycles and in
+ * nanoseconds, and its allocations and elements are taken from the
+ * counters supplied by the application.  Samples are kept per command, in
+ * a growing array, until 'stats reset'.
+ */
+typedef struct {
+    uint64_t seq; /* Position among all recorded commands */
+    int64_t cycles, ns;
+    int64_t allocs;
+    uint64_t elements;
+    bool ok;
+} cmd_sample_t;
+
+typedef struct __cmd_stats {
+    cmd_sample_t *samples;
+    size_t count, capacity;
+} cmd_stats_t;
+
+static int profile = 0;
+static uint64_t profile_seq = 0;
+static counter_func_t sample_counters = NULL;
 static bool has_infile = false;
 
 /* Optional function to call as part of exit process */
@@ -69,9 +114,71 @@ static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
+static char *readline();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slot holding name, or the empty slot where it belongs */
+static name_slot_t *name_slot(const name_table_t *t, const char *name)
+{
+    size_t mask = t->capacity - 1;
+    size_t i = name_hash(name) & mask;
+    while (t->slots[i].name && strcmp(t->slots[i].name, name) != 0)
+        i = (i + 1) & mask;
+    return &t->slots[i];
+}
+
+/* Find entry by name.  Return NULL if there is none */
+static void *name_find(const name_table_t *t, const char *name)
+{
+    return t->count ? name_slot(t, name)->entry : NULL;
+}
+
+/* Map name to entry, replacing any entry of the same name */
+static void name_put(name_table_t *t, const char *name, void *entry)
+{
+    if (2 * (t->count + 1) > t->capacity) {
+        name_table_t grown = {
+            .capacity = t->capacity ? 2 * t->capacity : NAME_TABLE_MIN,
+        };
+        grown.slots =
+            calloc_or_fail(grown.capacity, sizeof(name_slot_t), "name_put");
+        for (size_t i = 0; i < t->capacity; i++) {
+            if (t->slots[i].name)
+                *name_slot(&grown, t->slots[i].name) = t->slots[i];
+        }
+        grown.count = t->count;
+        if (t->slots)
+            free_array(t->slots, t->capacity, sizeof(name_slot_t));
+        *t = grown;
+    }
+
+    name_slot_t *slot = name_slot(t, name);
+    if (!slot->name) {
+        slot->name = name;
+        t->count++;
+    }
+    slot->entry = entry;
+}
+
+static void name_clear(name_table_t *t)
+{
+    if (t->slots)
+        free_array(t->slots, t->capacity, sizeof(name_slot_t));
+    memset(t, 0, sizeof(*t));
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +194,15 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->stats = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    name_put(&cmd_table, name, cmd);
+}
+
+void set_cmd_counters(counter_func_t counters)
+{
+    sample_counters = counters;
 }
 
 /* Add a new parameter */
@@ -109,6 +223,7 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    name_put(&param_table, name, param);
 }
 
 /* Parse a string into a command line */
@@ -129,7 +244,7 @@ static char **parse_args(char *line, int *argcp)
     int c;
     int argc = 0;
     while ((c = *src++) != '\0') {
-        if (isspace(c)) {
+        if (isspace((unsigned char) c)) {
             if (!skipping) {
                 /* Hit end of word */
                 *dst++ = '\0';
@@ -160,6 +275,18 @@ static char **parse_args(char *line, int *argcp)
     return argv;
 }
 
+static void free_stats(cmd_element_t *cmd)
+{
+    cmd_stats_t *stats = cmd->stats;
+    if (!stats)
+        return;
+
+    if (stats->samples)
+        free_array(stats->samples, stats->capacity, sizeof(cmd_sample_t));
+    free_block(stats, sizeof(cmd_stats_t));
+    cmd->stats = NULL;
+}
+
 /* Handles forced console termination for record_error and do_quit */
 static bool force_quit(int argc, char *argv[])
 {
@@ -168,6 +295,7 @@ static bool force_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        free_stats(ele);
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -177,6 +305,8 @@ static bool force_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    name_clear(&cmd_table);
+    name_clear(&param_table);
 
     while (buf_stack)
         pop_file();
@@ -200,18 +330,91 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static void read_counters(cmd_counters_t *counters)
+{
+    counters->allocs = 0;
+    counters->elements = 0;
+    if (sample_counters)
+        sample_counters(counters);
+}
+
+static int64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record_sample(cmd_element_t *cmd, const cmd_sample_t *sample)
+{
+    cmd_stats_t *stats = cmd->stats;
+    if (!stats) {
+        stats = calloc_or_fail(1, sizeof(cmd_stats_t), "record_sample");
+        cmd->stats = stats;
+    }
+
+    if (stats->count == stats->capacity) {
+        size_t capacity = stats->capacity ? 2 * stats->capacity : 64;
+        cmd_sample_t *samples =
+            calloc_or_fail(capacity, sizeof(cmd_sample_t), "record_sample");
+        if (stats->samples) {
+            memcpy(samples, stats->samples,
+                   stats->count * sizeof(cmd_sample_t));
+            free_array(stats->samples, stats->capacity, sizeof(cmd_sample_t));
+        }
+        stats->samples = samples;
+        stats->capacity = capacity;
+    }
+    stats->samples[stats->count++] = *sample;
+}
+
+/* Run a command, recording a sample of it */
+static bool run_profiled(cmd_element_t *cmd, int argc, char *argv[])
+{
+    cmd_counters_t before, after;
+
+    read_counters(&before);
+    int64_t ns = time_ns();
+    int64_t cycles = cpucycles();
+    bool ok = cmd->operation(argc, argv);
+    cycles = cpucycles() - cycles;
+    ns = time_ns() - ns;
+
+    /* The command list is gone after quit */
+    if (quit_flag)
+        return ok;
+
+    read_counters(&after);
+    cmd_sample_t sample = {
+        .seq = profile_seq++,
+        .cycles = cycles,
+        .ns = ns,
+        .allocs = after.allocs - before.allocs,
+        .ok = ok,
+    };
+    if (after.elements > before.elements)
+        sample.elements = after.elements - before.elements;
+    else if (after.elements < before.elements)
+        sample.elements = before.elements - after.elements;
+    else
+        sample.elements = after.elements;
+    record_sample(cmd, &sample);
+    return ok;
+}
+
+/* Find command by name.  Return NULL if there is none */
+static cmd_element_t *find_cmd(const char *name)
+{
+    return name_find(&cmd_table, name);
+}
+
+/* Execute a command that has been looked up, or report it unknown if NULL */
+static bool run_cmd(cmd_element_t *cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    if (cmd) {
+        ok = profile ? run_profiled(cmd, argc, argv)
+                     : cmd->operation(argc, argv);
         if (!ok)
             record_error();
     } else {
@@ -223,6 +426,14 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -326,7 +537,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -335,23 +545,15 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        param_element_t *param = name_find(&param_table, name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -372,6 +574,157 @@ static bool do_source(int argc, char *argv[])
     return true;
 }
 
+/* A trace loaded by replay.  The file is mapped once and split up front:
+ * the words of all lines are copied back to back into one buffer, each
+ * terminated, and every line gets its slice of one argv array and its
+ * command already looked up.  Running it then takes no parsing, lookup or
+ * allocation per line.
+ */
+typedef struct {
+    cmd_element_t *cmd; /* NULL for unknown command */
+    int argc;
+    char **argv;
+    const char *text; /* The line in the mapped file, for echo */
+    size_t len;
+} replay_line_t;
+
+typedef struct {
+    char *map;
+    size_t size;
+    size_t nlines, nwords;
+    replay_line_t *lines;
+    char **args;
+    char *words;
+} replay_t;
+
+/* Split the mapped file into lines and words.  With count set, only count
+ * them; otherwise fill in the arrays sized by the count
+ */
+static void replay_split(replay_t *r, bool count)
+{
+    const char *src = r->map, *end = r->map + r->size;
+    replay_line_t *line = r->lines;
+    char **arg = r->args;
+    char *dst = r->words;
+
+    while (src < end) {
+        const char *eol = memchr(src, '\n', end - src);
+        const char *next = eol ? eol + 1 : end;
+        const char *start = src;
+        int argc = 0;
+
+        while (src < next) {
+            while (src < next && isspace((unsigned char) *src))
+                src++;
+            if (src == next)
+                break;
+            argc++;
+            if (count) {
+                while (src < next && !isspace((unsigned char) *src))
+                    src++;
+                continue;
+            }
+            *arg++ = dst;
+            while (src < next && !isspace((unsigned char) *src))
+                *dst++ = *src++;
+            *dst++ = '\0';
+        }
+
+        if (count) {
+            r->nlines++;
+            r->nwords += argc;
+            continue;
+        }
+        line->argc = argc;
+        line->argv = arg - argc;
+        line->cmd = argc ? find_cmd(line->argv[0]) : NULL;
+        line->text = start;
+        line->len = next - start;
+        line++;
+    }
+}
+
+static bool replay_load(replay_t *r, const char *fname)
+{
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->size = st.st_size;
+    if (r->size) {
+        r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r->map == MAP_FAILED)
+            r->map = NULL;
+    }
+    close(fd);
+    if (r->size && !r->map)
+        return false;
+
+    replay_split(r, true);
+    r->lines = calloc_or_fail(r->nlines, sizeof(replay_line_t), "replay");
+    r->args = calloc_or_fail(r->nwords, sizeof(char *), "replay");
+    /* Each word is followed by a separator, or is last and ends the file */
+    r->words = malloc_or_fail(r->size + 1, "replay");
+    replay_split(r, false);
+    return true;
+}
+
+static void replay_free(replay_t *r)
+{
+    free_array(r->lines, r->nlines, sizeof(replay_line_t));
+    free_array(r->args, r->nwords, sizeof(char *));
+    free_block(r->words, r->size + 1);
+    if (r->map)
+        munmap(r->map, r->size);
+}
+
+static void replay_run(replay_t *r)
+{
+    for (size_t i = 0; i < r->nlines && !quit_flag; i++) {
+        replay_line_t *line = &r->lines[i];
+        if (echo) {
+            bool newline = line->text[line->len - 1] == '\n';
+            report_noreturn(1, "%s%.*s%s", prompt, (int) line->len,
+                            line->text, newline ? "" : "\n");
+        }
+        if (!line->argc)
+            continue;
+
+        /* Run files pushed by source before the rest of the trace */
+        rio_t *top = buf_stack;
+        run_cmd(line->cmd, line->argc, line->argv);
+        while (buf_stack != top && !quit_flag) {
+            char *cmdline = readline();
+            if (cmdline)
+                interpret_cmd(cmdline);
+        }
+    }
+}
+
+static bool do_replay(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "No replay file given. Use 'replay <file>'.");
+        return false;
+    }
+
+    replay_t r;
+    if (!replay_load(&r, argv[1])) {
+        report(1, "Could not open replay file '%s'", argv[1]);
+        return false;
+    }
+
+    replay_run(&r);
+    replay_free(&r);
+    return true;
+}
+
 static bool do_log(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -407,6 +760,172 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Summary of the samples of one command: percentiles of its time, means
+ * and totals of the rest
+ */
+typedef struct {
+    size_t count, failed;
+    int64_t ns[5]; /* p50, p90, p99, max and mean */
+    int64_t cycles[5];
+    int64_t allocs;
+    uint64_t elements;
+} cmd_summary_t;
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Fill out[] as described for cmd_summary_t, sorting values */
+static void percentiles(int64_t *values, size_t n, int64_t out[5])
+{
+    static const int ranks[] = {50, 90, 99, 100};
+    int64_t sum = 0;
+
+    qsort(values, n, sizeof(int64_t), cmp_int64);
+    for (size_t i = 0; i < 4; i++) {
+        /* Nearest rank */
+        size_t rank = (ranks[i] * n + 99) / 100;
+        out[i] = values[rank ? rank - 1 : 0];
+    }
+    for (size_t i = 0; i < n; i++)
+        sum += values[i];
+    out[4] = sum / (int64_t) n;
+}
+
+static void summarize(const cmd_stats_t *stats, cmd_summary_t *summary)
+{
+    size_t n = stats->count;
+    int64_t *values = calloc_or_fail(n, sizeof(int64_t), "summarize");
+
+    memset(summary, 0, sizeof(*summary));
+    summary->count = n;
+    for (size_t i = 0; i < n; i++) {
+        const cmd_sample_t *s = &stats->samples[i];
+        summary->failed += !s->ok;
+        summary->allocs += s->allocs;
+        summary->elements += s->elements;
+        values[i] = s->ns;
+    }
+    percentiles(values, n, summary->ns);
+    for (size_t i = 0; i < n; i++)
+        values[i] = stats->samples[i].cycles;
+    percentiles(values, n, summary->cycles);
+    free_array(values, n, sizeof(int64_t));
+}
+
+/* Elements per second over all the samples */
+static double element_rate(const cmd_summary_t *summary)
+{
+    double ns = (double) summary->ns[4] * summary->count;
+    return ns > 0 ? summary->elements * 1e9 / ns : 0;
+}
+
+static void show_stats()
+{
+    report(1, "%-9s %6s %9s %9s %9s %9s %9s %10s", "cmd", "count", "p50 us",
+           "p90 us", "p99 us", "max us", "allocs/op", "elements/s");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next) {
+        if (!cmd->stats || !cmd->stats->count)
+            continue;
+        cmd_summary_t summary;
+        summarize(cmd->stats, &summary);
+        report(1, "%-9s %6zu %9.1f %9.1f %9.1f %9.1f %9.1f %10.0f", cmd->name,
+               summary.count, summary.ns[0] / 1e3, summary.ns[1] / 1e3,
+               summary.ns[2] / 1e3, summary.ns[3] / 1e3,
+               (double) summary.allocs / summary.count,
+               element_rate(&summary));
+    }
+}
+
+/* One row per sample, in the order the commands ran within each command */
+static bool write_stats_csv(FILE *f)
+{
+    fprintf(f, "seq,cmd,ok,cycles,ns,allocs,elements\n");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next) {
+        for (size_t i = 0; cmd->stats && i < cmd->stats->count; i++) {
+            const cmd_sample_t *s = &cmd->stats->samples[i];
+            fprintf(f, "%llu,%s,%d,%lld,%lld,%lld,%llu\n",
+                    (unsigned long long) s->seq, cmd->name, s->ok,
+                    (long long) s->cycles, (long long) s->ns,
+                    (long long) s->allocs, (unsigned long long) s->elements);
+        }
+    }
+    return !ferror(f);
+}
+
+static void write_percentiles(FILE *f, const char *name, const int64_t v[5])
+{
+    fprintf(f,
+            "\"%s\": {\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, "
+            "\"max\": %lld, \"mean\": %lld}",
+            name, (long long) v[0], (long long) v[1], (long long) v[2],
+            (long long) v[3], (long long) v[4]);
+}
+
+/* One object per command with its summary */
+static bool write_stats_json(FILE *f)
+{
+    const char *sep = "";
+
+    fprintf(f, "{\"commands\": [");
+    for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next) {
+        if (!cmd->stats || !cmd->stats->count)
+            continue;
+        cmd_summary_t summary;
+        summarize(cmd->stats, &summary);
+        fprintf(f, "%s\n  {\"name\": \"%s\", \"count\": %zu, ", sep,
+                cmd->name, summary.count);
+        fprintf(f, "\"failed\": %zu, ", summary.failed);
+        write_percentiles(f, "ns", summary.ns);
+        fprintf(f, ", ");
+        write_percentiles(f, "cycles", summary.cycles);
+        fprintf(f,
+                ", \"allocs\": %lld, \"elements\": %llu, "
+                "\"elements_per_second\": %.0f}",
+                (long long) summary.allocs,
+                (unsigned long long) summary.elements, element_rate(&summary));
+        sep = ",";
+    }
+    fprintf(f, "\n]}\n");
+    return !ferror(f);
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc == 1) {
+        show_stats();
+        return true;
+    }
+
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        for (cmd_element_t *cmd = cmd_list; cmd; cmd = cmd->next)
+            free_stats(cmd);
+        profile_seq = 0;
+        return true;
+    }
+
+    bool csv = !strcmp(argv[1], "csv"), json = !strcmp(argv[1], "json");
+    if (argc != 3 || (!csv && !json)) {
+        report(1, "%s takes no arguments, 'reset', 'csv FILE' or 'json FILE'",
+               argv[0]);
+        return false;
+    }
+
+    FILE *f = fopen(argv[2], "w");
+    if (!f) {
+        report(1, "Couldn't open stats file '%s'", argv[2]);
+        return false;
+    }
+    bool ok = csv ? write_stats_csv(f) : write_stats_json(f);
+    if (fclose(f) || !ok) {
+        report(1, "Couldn't write stats file '%s'", argv[2]);
+        return false;
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -435,6 +954,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    name_clear(&cmd_table);
+    name_clear(&param_table);
     err_cnt = 0;
     quit_flag = false;
 
@@ -445,15 +966,24 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(hello, "Print hello message", "");
     ADD_COMMAND(source, "Read commands from source file", "file");
+    ADD_COMMAND(replay,
+                "Run commands from file, split and looked up all at once "
+                "before running",
+                "file");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(stats,
+                "Show per-command statistics recorded with option profile, "
+                "reset them, or write them as CSV samples or JSON summaries",
+                "[reset|csv FILE|json FILE]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("profile", &profile, "Record per-command statistics", NULL);
 
     init_in();
     init_time(&last_time);
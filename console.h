@@ -2,6 +2,7 @@
 #define LAB0_CONSOLE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 
 #include "linenoise.h"
@@ -24,9 +25,22 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    struct __cmd_stats *stats; /* Samples recorded with option profile */
     struct __cmd_element *next;
 } cmd_element_t;
 
+/* Counters sampled before and after each command with option profile */
+typedef struct {
+    uint64_t allocs;   /* Allocations made so far */
+    uint64_t elements; /* Size of the data commands work on */
+} cmd_counters_t;
+
+/* Optionally supply function that samples the counters.  A command is
+ * recorded as making the difference in allocations, and as working on the
+ * difference in elements, or on all of them if their number is unchanged.
+ */
+typedef void (*counter_func_t)(cmd_counters_t *counters);
+
 /* Optionally supply function that gets invoked when parameter changes */
 typedef void (*setter_func_t)(int oldval);
 
@@ -47,6 +61,9 @@ void init_cmd();
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 #define ADD_COMMAND(cmd, msg, param) add_cmd(#cmd, do_##cmd, msg, param)
 
+/* Set function sampling the counters of the per-command statistics */
+void set_cmd_counters(counter_func_t counters);
+
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
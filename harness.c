@@ -8,6 +8,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "dudect/cpucycles.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -30,23 +31,88 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+/* Header placed in front of every allocated block, 16 bytes so that
+ * payloads keep the alignment of the blocks
  */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    uint32_t slab_class : 8; /* Size class, or SLAB_NONE if from malloc */
+    uint32_t site : 24;      /* Call site charged in allocation statistics */
+    uint32_t magic_header;   /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
+/* Live blocks are registered in an open-addressed hash table keyed by header
+ * address, so that cautious mode can validate a pointer in O(1) rather than
+ * scanning every allocation.  Linear probing with backward-shift deletion
+ * keeps the table free of tombstones.
+ */
+#define ALLOC_TABLE_MIN 1024
+
+static block_element_t **alloc_table = NULL;
+static size_t alloc_table_size = 0; /* Always zero or a power of two */
+static int alloc_table_bits = 0;     /* Base-2 logarithm of the size */
 static size_t allocated_count = 0;
+/* Successful allocations since the start */
+static size_t allocation_count = 0;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Where blocks come from: ALLOCATOR_MALLOC or ALLOCATOR_SLAB */
+int allocator_mode = ALLOCATOR_MALLOC;
+
+/* Slab allocator.
+ * Blocks whose total size (header, payload and footer) fits one of the size
+ * classes below are carved out of large arenas obtained from malloc, and are
+ * recycled through a per-class free list.  Arenas are retained for the rest
+ * of the run.  Larger blocks always go to malloc.
+ */
+#define SLAB_NONE 0xff
+#define SLAB_ARENA_SIZE (1 << 20)
+
+static const size_t slab_sizes[] = {
+    48, 64, 80, 96, 128, 160, 192, 256, 384, 512, 768, 1072, 1536, 2048,
+};
+#define N_SLAB_CLASSES (sizeof(slab_sizes) / sizeof(slab_sizes[0]))
+
+typedef struct {
+    block_element_t *free_list;
+    unsigned char *bump, *end; /* Uncarved space in the newest arena */
+} slab_t;
+
+typedef struct __slab_arena {
+    struct __slab_arena *next;
+    size_t pad; /* Keep carved blocks 16-byte aligned */
+} slab_arena_t;
+
+static slab_t slabs[N_SLAB_CLASSES];
+static slab_arena_t *arenas = NULL;
+
+/* Allocation statistics.
+ * Blocks allocated by the code under test are charged to the source line
+ * that asked for them; direct calls to test_malloc() and friends share site
+ * 0.  Each block is also charged to the power-of-two class of its payload
+ * size, class k holding sizes up to 2^k.  Cycles are counted around the
+ * whole harness path, bookkeeping included.
+ */
+#define MEMSTAT_SITES 64
+#define MEMSTAT_CLASSES 40
+
+typedef struct {
+    const char *name;
+    size_t allocs, frees, fails;
+    size_t bytes;      /* Payload bytes ever allocated */
+    size_t live, peak; /* Payload bytes in use, and the most ever in use */
+    uint64_t alloc_cycles, free_cycles;
+} memstat_t;
+
+static memstat_t memstat_sites[MEMSTAT_SITES] = {{.name = "(direct)"}};
+static uint32_t memstat_nsites = 1;
+static memstat_t memstat_classes[MEMSTAT_CLASSES];
+static memstat_t memstat_total = {.name = "total"};
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
 static bool error_occurred = false;
@@ -74,6 +140,198 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
+static inline size_t alloc_hash(const block_element_t *b)
+{
+    /* Fibonacci hashing; the low bits of a malloc result carry no entropy,
+     * and the best-mixed bits of the product are its top ones
+     */
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> (64 - alloc_table_bits));
+}
+
+/* Return the slot holding b, or the empty slot where it would be placed */
+static size_t alloc_slot(const block_element_t *b)
+{
+    size_t i = alloc_hash(b);
+    while (alloc_table[i] && alloc_table[i] != b)
+        i = (i + 1) & (alloc_table_size - 1);
+    return i;
+}
+
+static bool alloc_table_resize(size_t new_size)
+{
+    block_element_t **old_table = alloc_table;
+    size_t old_size = alloc_table_size;
+
+    block_element_t **new_table = calloc(new_size, sizeof(block_element_t *));
+    if (!new_table)
+        return false;
+
+    alloc_table = new_table;
+    alloc_table_size = new_size;
+    for (alloc_table_bits = 0; (size_t) 1 << alloc_table_bits < new_size;)
+        alloc_table_bits++;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_table[i])
+            alloc_table[alloc_slot(old_table[i])] = old_table[i];
+    }
+    free(old_table);
+    return true;
+}
+
+/* Record b as a live block.  Keep the load factor at or below one half */
+static bool alloc_table_insert(block_element_t *b)
+{
+    if (2 * (allocated_count + 1) > alloc_table_size &&
+        !alloc_table_resize(alloc_table_size ? 2 * alloc_table_size
+                                              : ALLOC_TABLE_MIN))
+        return false;
+
+    alloc_table[alloc_slot(b)] = b;
+    return true;
+}
+
+static bool alloc_table_contains(const block_element_t *b)
+{
+    return alloc_table_size && alloc_table[alloc_slot(b)] == b;
+}
+
+/* Remove b, shifting back any entry whose probe sequence crossed its slot */
+static void alloc_table_remove(const block_element_t *b)
+{
+    if (!alloc_table_size)
+        return;
+
+    size_t mask = alloc_table_size - 1;
+    size_t hole = alloc_slot(b);
+    if (!alloc_table[hole])
+        return;
+
+    for (size_t i = (hole + 1) & mask; alloc_table[i]; i = (i + 1) & mask) {
+        size_t home = alloc_hash(alloc_table[i]);
+        /* Move the entry only if its home is not cyclically in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            alloc_table[hole] = alloc_table[i];
+            hole = i;
+        }
+    }
+    alloc_table[hole] = NULL;
+}
+
+/* A free slab block keeps the link of its free list in its payload, which
+ * even the smallest class has room for
+ */
+static inline block_element_t **slab_next_free(block_element_t *b)
+{
+    return (block_element_t **) b->payload;
+}
+
+/* Return the smallest size class holding total bytes, or SLAB_NONE */
+static uint32_t slab_class_of(size_t total)
+{
+    for (uint32_t i = 0; i < N_SLAB_CLASSES; i++) {
+        if (total <= slab_sizes[i])
+            return i;
+    }
+    return SLAB_NONE;
+}
+
+static block_element_t *slab_alloc(uint32_t cls)
+{
+    slab_t *slab = &slabs[cls];
+    block_element_t *b = slab->free_list;
+    if (b) {
+        slab->free_list = *slab_next_free(b);
+        return b;
+    }
+
+    if ((size_t) (slab->end - slab->bump) < slab_sizes[cls]) {
+        slab_arena_t *arena = malloc(SLAB_ARENA_SIZE);
+        if (!arena)
+            return NULL;
+        arena->next = arenas;
+        arenas = arena;
+        slab->bump = (unsigned char *) (arena + 1);
+        slab->end = (unsigned char *) arena + SLAB_ARENA_SIZE;
+    }
+
+    b = (block_element_t *) slab->bump;
+    slab->bump += slab_sizes[cls];
+    return b;
+}
+
+static void slab_free(block_element_t *b)
+{
+    slab_t *slab = &slabs[b->slab_class];
+    *slab_next_free(b) = slab->free_list;
+    slab->free_list = b;
+}
+
+/* Return the index of the statistics for site, registering it if needed */
+static uint32_t memstat_site(const char *site)
+{
+    if (!site)
+        return 0;
+
+    /* Most lookups hit the same string literal */
+    for (uint32_t i = 1; i < memstat_nsites; i++) {
+        if (memstat_sites[i].name == site)
+            return i;
+    }
+    for (uint32_t i = 1; i < memstat_nsites; i++) {
+        if (!strcmp(memstat_sites[i].name, site))
+            return i;
+    }
+    if (memstat_nsites == MEMSTAT_SITES)
+        return 0;
+    memstat_sites[memstat_nsites].name = site;
+    return memstat_nsites++;
+}
+
+static memstat_t *memstat_class(size_t size)
+{
+    size_t cls = 0;
+    while (cls < MEMSTAT_CLASSES - 1 && ((size_t) 1 << cls) < size)
+        cls++;
+    return &memstat_classes[cls];
+}
+
+/* Charge an event to the totals, the site and the size class */
+static void memstat_alloc(uint32_t site, size_t size, int64_t cycles)
+{
+    memstat_t *stats[] = {&memstat_total, &memstat_sites[site],
+                          memstat_class(size)};
+
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        memstat_t *m = stats[i];
+        m->allocs++;
+        m->bytes += size;
+        m->live += size;
+        if (m->live > m->peak)
+            m->peak = m->live;
+        m->alloc_cycles += cycles;
+    }
+}
+
+static void memstat_free(uint32_t site, size_t size, int64_t cycles)
+{
+    memstat_t *stats[] = {&memstat_total, &memstat_sites[site],
+                          memstat_class(size)};
+
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        stats[i]->frees++;
+        stats[i]->live -= size;
+        stats[i]->free_cycles += cycles;
+    }
+}
+
+static void memstat_fail(uint32_t site, size_t size)
+{
+    memstat_total.fails++;
+    memstat_sites[site].fails++;
+    memstat_class(size)->fails++;
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -88,13 +346,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!alloc_table_contains(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -122,14 +374,18 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *alloc(alloc_t alloc_type, size_t size, const char *site)
 {
+    int64_t start = cpucycles();
+    uint32_t site_index = memstat_site(site);
+
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
             "Calls to malloc are disallowed",
             "Calls to calloc are disallowed",
         };
         report_event(MSG_FATAL, "%s", msg_alloc_forbidden[alloc_type]);
+        memstat_fail(site_index, size);
         return NULL;
     }
 
@@ -139,12 +395,21 @@ static void *alloc(alloc_t alloc_type, size_t size)
             "Calloc returning NULL",
         };
         report_event(MSG_WARN, "%s", msg_alloc_failure[alloc_type]);
+        memstat_fail(site_index, size);
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    size_t total = size + sizeof(block_element_t) + sizeof(size_t);
+    uint32_t cls = SLAB_NONE;
+    block_element_t *new_block = NULL;
+    if (allocator_mode == ALLOCATOR_SLAB &&
+        (cls = slab_class_of(total)) != SLAB_NONE)
+        new_block = slab_alloc(cls);
     if (!new_block) {
+        cls = SLAB_NONE;
+        new_block = malloc(total);
+    }
+    if (!new_block || !alloc_table_insert(new_block)) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
@@ -153,19 +418,17 @@ static void *alloc(alloc_t alloc_type, size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->slab_class = cls;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->site = site_index;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
     allocated_count++;
+    allocation_count++;
 
+    memstat_alloc(site_index, size, cpucycles() - start);
     return p;
 }
 
@@ -173,18 +436,28 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, NULL);
 }
 
-// cppcheck-suppress unusedFunction
-void *test_calloc(size_t nelem, size_t elsize)
+void *test_malloc_at(size_t size, const char *site)
+{
+    return alloc(TEST_MALLOC, size, site);
+}
+
+void *test_calloc_at(size_t nelem, size_t elsize, const char *site)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, site);
+}
+
+// cppcheck-suppress unusedFunction
+void *test_calloc(size_t nelem, size_t elsize)
+{
+    return test_calloc_at(nelem, elsize, NULL);
 }
 
 void test_free(void *p)
@@ -197,7 +470,17 @@ void test_free(void *p)
     if (!p)
         return;
 
+    int64_t start = cpucycles();
     block_element_t *b = find_header(p);
+    /* find_header() has reported a block that is not live.  Leave it alone:
+     * a released slab block holds its free-list link in its payload, and
+     * it must not be queued or counted twice
+     */
+    if (b->magic_header != MAGICHEADER)
+        return;
+
+    uint32_t site = b->site;
+    size_t size = b->payload_size;
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -210,36 +493,117 @@ void test_free(void *p)
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    alloc_table_remove(b);
 
-    free(b);
+    if (b->slab_class == SLAB_NONE)
+        free(b);
+    else
+        slab_free(b);
     allocated_count--;
+
+    memstat_free(site < memstat_nsites ? site : 0, size, cpucycles() - start);
 }
 
-// cppcheck-suppress unusedFunction
-char *test_strdup(const char *s)
+char *test_strdup_at(const char *s, const char *site)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, site);
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+// cppcheck-suppress unusedFunction
+char *test_strdup(const char *s)
+{
+    return test_strdup_at(s, NULL);
+}
+
 size_t allocation_check()
 {
     return allocated_count;
 }
 
+size_t allocation_total()
+{
+    return allocation_count;
+}
+
+static void memstat_clear(memstat_t *m)
+{
+    m->allocs = m->frees = m->fails = m->bytes = 0;
+    m->peak = m->live;
+    m->alloc_cycles = m->free_cycles = 0;
+}
+
+void memstat_reset()
+{
+    memstat_clear(&memstat_total);
+    for (uint32_t i = 0; i < memstat_nsites; i++)
+        memstat_clear(&memstat_sites[i]);
+    for (size_t i = 0; i < MEMSTAT_CLASSES; i++)
+        memstat_clear(&memstat_classes[i]);
+}
+
+static void memstat_show_row(int vlevel, const char *name, const memstat_t *m)
+{
+    if (!m->allocs && !m->frees && !m->fails && !m->live)
+        return;
+    report(vlevel, "%-22s %8zu %8zu %10zu %10zu %7.0f %7.0f", name, m->allocs,
+           m->frees, m->live, m->peak,
+           m->allocs ? (double) m->alloc_cycles / m->allocs : 0.0,
+           m->frees ? (double) m->free_cycles / m->frees : 0.0);
+}
+
+void memstat_show(int vlevel)
+{
+    char name[32];
+
+    report(vlevel, "%-22s %8s %8s %10s %10s %7s %7s", "site", "allocs",
+           "frees", "live", "peak", "cyc/a", "cyc/f");
+    for (uint32_t i = 0; i < memstat_nsites; i++)
+        memstat_show_row(vlevel, memstat_sites[i].name, &memstat_sites[i]);
+    for (size_t i = 0; i < MEMSTAT_CLASSES; i++) {
+        snprintf(name, sizeof(name), "<= %zu bytes", (size_t) 1 << i);
+        memstat_show_row(vlevel, name, &memstat_classes[i]);
+    }
+    memstat_show_row(vlevel, memstat_total.name, &memstat_total);
+    if (memstat_total.fails)
+        report(vlevel, "%zu allocations failed", memstat_total.fails);
+}
+
+static void memstat_dump_row(FILE *f,
+                             const char *kind,
+                             const char *name,
+                             const memstat_t *m)
+{
+    fprintf(f, "%s,%s,%zu,%zu,%zu,%zu,%zu,%zu,%llu,%llu\n", kind, name,
+            m->allocs, m->frees, m->fails, m->bytes, m->live, m->peak,
+            (unsigned long long) m->alloc_cycles,
+            (unsigned long long) m->free_cycles);
+}
+
+bool memstat_dump(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f)
+        return false;
+
+    char name[32];
+    fprintf(f,
+            "kind,name,allocs,frees,fails,bytes,live,peak,alloc_cycles,"
+            "free_cycles\n");
+    for (uint32_t i = 0; i < memstat_nsites; i++)
+        memstat_dump_row(f, "site", memstat_sites[i].name, &memstat_sites[i]);
+    for (size_t i = 0; i < MEMSTAT_CLASSES; i++) {
+        snprintf(name, sizeof(name), "%zu", (size_t) 1 << i);
+        memstat_dump_row(f, "class", name, &memstat_classes[i]);
+    }
+    memstat_dump_row(f, "total", memstat_total.name, &memstat_total);
+    return !fclose(f);
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
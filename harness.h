@@ -16,14 +16,41 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* Same, charging the block to a call site for the allocation statistics.
+ * site must stay valid for the rest of the run, like a string literal.
+ */
+void *test_malloc_at(size_t size, const char *site);
+void *test_calloc_at(size_t nmemb, size_t size, const char *site);
+char *test_strdup_at(const char *s, const char *site);
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report number of successful allocations so far, never decreasing */
+size_t allocation_total();
+
+/* Allocation statistics, by call site and by power-of-two size class:
+ * counts, bytes, bytes in use and their peak, and cycles spent allocating
+ * and freeing.  Resetting keeps the blocks still in use.
+ */
+void memstat_reset();
+void memstat_show(int vlevel);
+
+/* Write the statistics to filename as CSV.  Return false on failure */
+bool memstat_dump(const char *filename);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Backend that test_malloc obtains blocks from */
+enum {
+    ALLOCATOR_MALLOC, /* One libc malloc call per block */
+    ALLOCATOR_SLAB,   /* Size-class slabs carved out of large arenas */
+};
+extern int allocator_mode;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -53,14 +80,20 @@ void trigger_exception(char *msg);
 
 #else /* !INTERNAL */
 
-/* Tested program use our versions of malloc and free */
-#define malloc test_malloc
-#define calloc test_calloc
+/* Tested program use our versions of malloc and free, which charge each
+ * block to the source line allocating it
+ */
+#define HARNESS_STR(x) #x
+#define HARNESS_SITE(line) __FILE__ ":" HARNESS_STR(line)
+
+#define malloc(size) test_malloc_at(size, HARNESS_SITE(__LINE__))
+#define calloc(nmemb, size) \
+    test_calloc_at(nmemb, size, HARNESS_SITE(__LINE__))
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) test_strdup_at(s, HARNESS_SITE(__LINE__))
 
 #endif
 
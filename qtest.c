@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,6 +20,7 @@
 #include <time.h>
 #endif
 
+#include "bench.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -53,7 +55,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,6 +76,27 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Buckets per axis for the shuffle uniformity test, 0 to disable it */
+static int shuffle_buckets = 0;
+
+/* Threads used by q_sort */
+static int sort_threads = 1;
+
+/* Whether ih and it hand freshly allocated strings to q_insert_*_move */
+static int move_insert = 0;
+
+/* Algorithm used by q_sort, see SORT_AUTO and friends */
+static int sort_mode = SORT_AUTO;
+
+/* Order used by sort, dedup, ascend, descend and merge, an index of orders */
+static const queue_order_t *const orders[] = {
+    &q_order_string,
+    &q_order_numeric,
+    &q_order_nocase,
+    &q_order_length,
+};
+static int order_index = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -86,6 +108,13 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
+/* The current queue as a list, threaded first if it is a ring queue */
+static struct list_head *qlist(void)
+{
+    q_link(current->q);
+    return current->q;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -101,9 +130,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,7 +142,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -140,8 +165,10 @@ static bool do_free(int argc, char *argv[])
 
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool ring = argc == 2 && !strcmp(argv[1], "ring");
+    bool unrolled = argc == 2 && !strcmp(argv[1], "unrolled");
+    if (argc != 1 && !ring && !unrolled) {
+        report(1, "%s takes no arguments, 'ring' or 'unrolled'", argv[0]);
         return false;
     }
 
@@ -152,7 +179,9 @@ static bool do_new(int argc, char *argv[])
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
-        qctx->q = q_new();
+        qctx->q = ring       ? q_new_ring()
+                  : unrolled ? q_new_unrolled()
+                             : q_new();
         qctx->id = chain.size++;
 
         current = qctx;
@@ -200,7 +229,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    char randstr_buf[MAX_RANDSTR_LEN] = "";
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -228,20 +257,55 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
-                                        : q_insert_head(current->q, inserts);
+            char *moved = NULL;
+            bool rval;
+            if (move_insert) {
+                /* Build the string right in the buffer handed over.  Only
+                 * the queue is subject to injected malloc failures
+                 */
+                size_t len =
+                    need_rand ? sizeof(randstr_buf) : strlen(argv[1]) + 1;
+                int saved_fail_probability = fail_probability;
+                fail_probability = 0;
+                moved = test_malloc(len);
+                fail_probability = saved_fail_probability;
+                if (!moved) {
+                    report(1,
+                           "INTERNAL ERROR.  Could not allocate string to "
+                           "hand over");
+                    ok = false;
+                    break;
+                }
+                if (need_rand)
+                    fill_rand_string(moved, len);
+                else
+                    memcpy(moved, argv[1], len);
+                rval = pos == POS_TAIL ? q_insert_tail_move(current->q, moved)
+                                       : q_insert_head_move(current->q, moved);
+            } else {
+                if (need_rand)
+                    fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
+                                       : q_insert_head(current->q, inserts);
+            }
             if (rval) {
                 current->size++;
                 element_t *entry =
                     pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
+                        ? list_last_entry(qlist(), element_t, list)
+                        : list_first_entry(qlist(), element_t, list);
                 char *cur_inserts = entry->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
+                } else if (move_insert) {
+                    if (cur_inserts != moved) {
+                        report(1,
+                               "ERROR: Need to store the string handed over "
+                               "instead of a copy");
+                        ok = false;
+                        break;
+                    }
                 } else if (r == 0 && inserts == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
@@ -257,15 +321,18 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                 }
                 lasts = cur_inserts;
             } else {
+                const char *shown = moved ? moved : inserts;
                 fail_count++;
                 if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
+                    report(2, "Insertion of %s failed", shown);
                 else {
                     report(1,
                            "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                           shown, fail_count);
                     ok = false;
                 }
+                /* A string that was not taken over is still ours */
+                test_free(moved);
             }
             ok = ok && !error_check();
         }
@@ -288,6 +355,140 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* Strings handed to each q_insert_bulk() call by ihb and itb */
+#define BULK_CHUNK 4096
+
+/* Like fill_rand_string() for count buffers, drawing the random bytes for
+ * the whole batch at once.  One 64-bit draw yields every character of a
+ * string, as 26^9 < 2^64.
+ */
+static void fill_rand_strings(char bufs[][MAX_RANDSTR_LEN], size_t count)
+{
+    uint64_t draws[BULK_CHUNK];
+
+    randombytes((uint8_t *) draws, count * sizeof(uint64_t));
+    for (size_t i = 0; i < count; i++) {
+        size_t len = 0;
+        while (len < MIN_RANDSTR_LEN)
+            len = rand() % MAX_RANDSTR_LEN;
+
+        for (size_t n = 0; n < len; n++) {
+            bufs[i][n] = charset[draws[i] % (sizeof(charset) - 1)];
+            draws[i] /= sizeof(charset) - 1;
+        }
+        bufs[i][len] = '\0';
+    }
+}
+
+/* First of the n elements at pos of the current queue */
+static struct list_head *bulk_start(position_t pos, int n)
+{
+    struct list_head *node = qlist()->next;
+    if (pos == POS_TAIL) {
+        node = current->q;
+        for (int i = 0; i < n; i++)
+            node = node->prev;
+    }
+    return node;
+}
+
+/* Check the n elements just inserted at pos by q_insert_bulk() */
+static bool check_bulk(position_t pos, char *const strings[], int n)
+{
+    struct list_head *node = bulk_start(pos, n);
+
+    for (int i = 0; i < n; i++, node = node->next) {
+        const char *value = list_entry(node, element_t, list)->value;
+        if (!value) {
+            report(1, "ERROR: Failed to save copy of string in queue");
+            return false;
+        }
+        if (value == strings[i]) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            return false;
+        }
+        if (strcmp(value, strings[i])) {
+            report(1, "ERROR: Batch not inserted in order, expected %s at %d",
+                   strings[i], i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* bulk insertion */
+static bool queue_insert_bulk(position_t pos, int argc, char *argv[])
+{
+    static char randstr_bufs[BULK_CHUNK][MAX_RANDSTR_LEN];
+    char *strings[BULK_CHUNK];
+    int reps = 1;
+    bool ok = true;
+
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 3) {
+        if (!get_int(argv[2], &reps) || reps < 1) {
+            report(1, "Invalid number of insertions '%s'", argv[2]);
+            return false;
+        }
+    }
+
+    bool need_rand = !strcmp(argv[1], "RAND");
+    for (int i = 0; i < BULK_CHUNK; i++)
+        strings[i] = need_rand ? randstr_bufs[i] : argv[1];
+
+    if (!current || !current->q)
+        report(3, "Warning: Calling insert %s on null queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    if (current && exception_setup(true)) {
+        for (int done = 0; ok && done < reps;) {
+            int n = reps - done < BULK_CHUNK ? reps - done : BULK_CHUNK;
+            if (need_rand)
+                fill_rand_strings(randstr_bufs, n);
+            if (q_insert_bulk(current->q, strings, n, pos == POS_TAIL)) {
+                current->size += n;
+                ok = check_bulk(pos, strings, n);
+            } else {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %d x %s failed", n, argv[1]);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %d x %s failed (%d failures "
+                           "total)",
+                           n, argv[1], fail_count);
+                    ok = false;
+                }
+            }
+            done += n;
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    q_show(3);
+    return ok;
+}
+
+/* bulk insert head */
+static bool do_ihb(int argc, char *argv[])
+{
+    return queue_insert_bulk(POS_HEAD, argc, argv);
+}
+
+/* bulk insert tail */
+static bool do_itb(int argc, char *argv[])
+{
+    return queue_insert_bulk(POS_TAIL, argc, argv);
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -417,10 +618,27 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+static int value_cmp(const void *a, const void *b)
+{
+    return q_compare(*(const char *const *) a, *(const char *const *) b);
+}
+
+/* Whether s occurs exactly once in the sorted array of n strings */
+static bool occurs_once(const char **sorted, size_t n, const char *s)
+{
+    const char **found = bsearch(&s, sorted, n, sizeof(*sorted), value_cmp);
+    if (!found)
+        return false;
+    size_t i = found - sorted;
+    return (i == 0 || q_compare(sorted[i - 1], s)) &&
+           (i == n - 1 || q_compare(sorted[i + 1], s));
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool all = argc == 2 && !strcmp(argv[1], "all");
+    if (argc != 1 && !all) {
+        report(1, "%s takes no arguments, or 'all'", argv[0]);
         return false;
     }
 
@@ -433,7 +651,7 @@ static bool do_dedup(int argc, char *argv[])
     element_t *item = NULL, *tmp = NULL;
 
     // Copy current->q to l_copy
-    if (current->q && !list_empty(current->q)) {
+    if (current->q && !list_empty(qlist())) {
         list_for_each_entry(item, current->q, list) {
             size_t slen;
             tmp = malloc(sizeof(element_t));
@@ -462,9 +680,32 @@ static bool do_dedup(int argc, char *argv[])
         }
     }
 
+    /* Duplicates anywhere in the queue are found by binary search */
+    const char **sorted = NULL;
+    size_t n = 0;
+    if (all)
+        n = current->size;
+    if (n) {
+        sorted = malloc(n * sizeof(*sorted));
+        if (!sorted) {
+            list_for_each_entry_safe(item, tmp, &l_copy, list) {
+                free(item->value);
+                free(item);
+            }
+            report(1,
+                   "INTERNAL ERROR.  Could not allocate space for "
+                   "duplicate checking");
+            return false;
+        }
+        size_t i = 0;
+        list_for_each_entry(item, &l_copy, list)
+            sorted[i++] = item->value;
+        qsort(sorted, n, sizeof(*sorted), value_cmp);
+    }
+
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_dup(current->q);
+        ok = all ? q_delete_dup_all(current->q) : q_delete_dup(current->q);
     exception_cancel();
 
     if (!ok) {
@@ -472,20 +713,34 @@ static bool do_dedup(int argc, char *argv[])
             free(item->value);
             free(item);
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
+        free(sorted);
+        if (!all || list_empty(qlist())) {
+            report(1, "ERROR: Calling delete duplicate on null queue");
+            return false;
+        }
+        /* The hash set could not be allocated; the queue is untouched */
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Deduplication failed");
+            return true;
+        }
+        report(1, "ERROR: Deduplication failed (%d failures total)",
+               fail_count);
         return false;
     }
 
-    struct list_head *l_tmp = current->q->next;
+    struct list_head *l_tmp = qlist()->next;
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry(item, &l_copy, list) {
         // Skip comparison with new list if the string is duplicate
         bool is_next_dup =
             item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
-        if (is_this_dup || is_next_dup) {
+            q_compare(list_entry(item->list.next, element_t, list)->value,
+                      item->value) == 0;
+        bool dup = all ? !occurs_once(sorted, n, item->value)
+                       : is_this_dup || is_next_dup;
+        if (dup) {
             // Update list size
             current->size--;
         } else if (l_tmp != current->q &&
@@ -507,11 +762,126 @@ static bool do_dedup(int argc, char *argv[])
         free(item->value);
         free(item);
     }
+    free(sorted);
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* bulk removal */
+static bool queue_remove_bulk(position_t pos, int argc, char *argv[])
+{
+    int reps = 1;
+    bool ok = true;
+
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 2) {
+        if (!get_int(argv[1], &reps) || reps < 1) {
+            report(1, "Invalid number of removals '%s'", argv[1]);
+            return false;
+        }
+    }
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove %s on empty queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    /* Pack the values to be removed for comparison, and pad the buffer
+     * q_remove_bulk() fills to catch overflows.  As with rh and rt, the
+     * buffer holds at most string_length characters, so long batches are
+     * truncated.
+     */
+    int n = 0;
+    if (current)
+        n = current->size < reps ? current->size : reps;
+    size_t packed = 0;
+    struct list_head *node = n ? bulk_start(pos, n) : NULL;
+    for (int i = 0; i < n; i++, node = node->next)
+        packed += strlen(list_entry(node, element_t, list)->value) + 1;
+    size_t bufsize = packed < string_length + 1 ? packed : string_length + 1;
+
+    char *checks = malloc(packed + 1);
+    char *removes = malloc(bufsize + STRINGPAD);
+    if (!checks || !removes) {
+        free(checks);
+        free(removes);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        return false;
+    }
+    size_t used = 0;
+    node = n ? bulk_start(pos, n) : NULL;
+    for (int i = 0; i < n; i++, node = node->next) {
+        const char *value = list_entry(node, element_t, list)->value;
+        size_t len = strlen(value) + 1;
+        memcpy(checks + used, value, len);
+        used += len;
+    }
+    /* The last string copied is cut short, but still terminated */
+    if (bufsize)
+        checks[bufsize - 1] = '\0';
+    memset(removes, 'X', bufsize + STRINGPAD);
+
+    LIST_HEAD(removed);
+    int got = 0;
+    if (current && exception_setup(true))
+        got = q_remove_bulk(current->q, &removed, reps, pos == POS_TAIL,
+                            removes, bufsize);
+    exception_cancel();
+
+    int count = 0;
+    element_t *item, *tmp;
+    list_for_each_entry_safe(item, tmp, &removed, list) {
+        q_release_element(item);
+        count++;
+    }
+
+    if (got != n || count != n) {
+        report(1, "ERROR: Removed %d elements (%d returned), expected %d",
+               count, got, n);
+        ok = false;
+    } else if (memcmp(removes, checks, bufsize)) {
+        report(1, "ERROR: Removed values differ from the queue's");
+        ok = false;
+    } else {
+        size_t i = bufsize;
+        while (i < bufsize + STRINGPAD && removes[i] == 'X')
+            i++;
+        if (i != bufsize + STRINGPAD) {
+            report(1,
+                   "ERROR: copying of strings in remove_bulk overflowed "
+                   "destination buffer.");
+            ok = false;
+        } else {
+            report(2, "Removed %d elements from queue", count);
+        }
+    }
+    if (current)
+        current->size -= count;
 
+    free(checks);
+    free(removes);
     q_show(3);
     return ok && !error_check();
 }
 
+/* bulk remove head */
+static bool do_rhb(int argc, char *argv[])
+{
+    return queue_remove_bulk(POS_HEAD, argc, argv);
+}
+
+/* bulk remove tail */
+static bool do_rtb(int argc, char *argv[])
+{
+    return queue_remove_bulk(POS_TAIL, argc, argv);
+}
+
 static bool do_reverse(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -604,6 +974,7 @@ bool do_sort(int argc, char *argv[])
     unsigned no = 0;
     if (current && current->size && current->size <= MAX_NODES) {
         element_t *entry;
+        q_link(current->q);
         list_for_each_entry(entry, current->q, list)
             nodes[no++] = &entry->list;
     } else if (current && current->size > MAX_NODES)
@@ -619,26 +990,26 @@ bool do_sort(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
+        for (struct list_head *cur_l = qlist()->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending/descending order */
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            if (!descend && q_compare(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && q_compare(item->value, next_item->value) < 0) {
                 report(1, "ERROR: Not sorted in descending order");
                 ok = false;
                 break;
             }
             /* Ensure the stability of the sort */
             if (current->size <= MAX_NODES &&
-                !strcmp(item->value, next_item->value)) {
+                !q_compare(item->value, next_item->value)) {
                 bool unstable = false;
                 for (unsigned i = 0; i < MAX_NODES; i++) {
                     if (nodes[i] == cur_l->next) {
@@ -747,12 +1118,12 @@ static bool do_ascend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
+        for (struct list_head *cur_l = qlist()->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) > 0) {
+            if (q_compare(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -794,12 +1165,12 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
+        for (struct list_head *cur_l = qlist()->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) < 0) {
+            if (q_compare(item->value, next_item->value) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -862,7 +1233,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -881,13 +1252,13 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
+        for (struct list_head *cur_l = qlist()->next;
              cur_l != current->q && --len; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            if (!descend && q_compare(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
                        "of unsorted queues are merged or there're some flaws "
@@ -897,7 +1268,7 @@ static bool do_merge(int argc, char *argv[])
             }
 
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && q_compare(item->value, next_item->value) < 0) {
                 report(
                     1,
                     "ERROR: Not sorted in descending order (It might because "
@@ -913,53 +1284,182 @@ static bool do_merge(int argc, char *argv[])
     return ok && !error_check();
 }
 
-// static bool do_shuffle(int argc, char *argv[])
-// {
-//     if (argc != 1 && argc != 2) {
-//         report(1, "%s takes 0-1 arguments", argv[0]);
-//         return false;
-//     }
-
-//     int reps = 1;
-//     bool ok = true;
-//     if (argc == 2) {
-//         if (!get_int(argv[1], &reps))
-//             report(1, "Invalid number of calls to size '%s'", argv[2]);
-//     }
-
-//     if (!current || !current->q)
-//         report(3, "Warning: Calling size on null queue");
-//     error_check();
-
-//     if (current && exception_setup(true)) {
-//         for (int r = 0; ok && r < reps; r++) {
-//             q_shuffle(current->q);
-//             ok = ok && !error_check();
-//         }
-//     }
-//     exception_cancel();
-
-//     if (current && ok) {
-//         int expected_size = current->size;
-//         int actual_size = q_size(current->q);
-
-//         if (expected_size != actual_size) {
-//             report(1,
-//                    "ERROR: Queue size mismatch after shuffle. Expected: %d, "
-//                    "Got: %d",
-//                    expected_size, actual_size);
-//             ok = false;
-//         }
-//     }
-
-//     q_show(3);
-
-//     return ok && !error_check();
-// }
+/* Pair of a node and its position, used to locate nodes after a shuffle */
+typedef struct {
+    const struct list_head *node;
+    size_t index;
+} node_index_t;
+
+static int node_index_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) ((const node_index_t *) a)->node;
+    uintptr_t y = (uintptr_t) ((const node_index_t *) b)->node;
+    return (x > y) - (x < y);
+}
+
+/* Bucket of index i when n indices are split into nb equal ranges */
+static inline size_t bucket_of(size_t i, size_t n, size_t nb)
+{
+    return (size_t) ((uint64_t) i * nb / n);
+}
+
+/* Shuffle the queue reps times and run a chi-square test on where elements
+ * land.  Original positions and new positions are both grouped into nb
+ * buckets; for a uniform shuffle every (from, to) bucket pair is hit in
+ * proportion to the product of the bucket sizes.  This scales to queues far
+ * too long for counting whole permutations.
+ */
+static bool shuffle_stats(int reps, size_t nb)
+{
+    size_t n = current->size;
+    node_index_t *index = malloc(n * sizeof(node_index_t));
+    uint64_t *counts = calloc(nb * nb, sizeof(uint64_t));
+    uint64_t *widths = calloc(nb, sizeof(uint64_t));
+    if (!index || !counts || !widths) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for statistics");
+        free(index);
+        free(counts);
+        free(widths);
+        return false;
+    }
+
+    size_t i = 0;
+    const struct list_head *node;
+    q_link(current->q);
+    list_for_each (node, current->q) {
+        index[i].node = node;
+        index[i].index = i;
+        widths[bucket_of(i, n, nb)]++;
+        i++;
+    }
+    qsort(index, n, sizeof(node_index_t), node_index_cmp);
+
+    /* Collecting statistics is expected to be slow, so no time limit */
+    bool ok = true, shuffled = true;
+    if (exception_setup(false)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (!q_shuffle(current->q)) {
+                shuffled = false;
+                break;
+            }
+            q_link(current->q);
+            size_t pos = 0;
+            list_for_each (node, current->q) {
+                node_index_t key = {.node = node};
+                const node_index_t *found =
+                    bsearch(&key, index, n, sizeof(node_index_t),
+                            node_index_cmp);
+                if (!found || pos >= n) {
+                    ok = false;
+                    break;
+                }
+                counts[bucket_of(found->index, n, nb) * nb +
+                       bucket_of(pos, n, nb)]++;
+                pos++;
+            }
+            ok = ok && pos == n && !error_check();
+        }
+    }
+    exception_cancel();
+
+    if (!shuffled) {
+        report(1, "ERROR: Shuffle failed");
+        ok = false;
+    } else if (!ok) {
+        report(1, "ERROR: Shuffle lost or duplicated elements");
+    } else {
+        double chi2 = 0;
+        for (size_t from = 0; from < nb; from++) {
+            for (size_t to = 0; to < nb; to++) {
+                double expect =
+                    (double) reps * widths[from] * widths[to] / (double) n;
+                double diff = counts[from * nb + to] - expect;
+                chi2 += diff * diff / expect;
+            }
+        }
+        double dof = (double) (nb - 1) * (nb - 1);
+        /* Chi-square with k degrees of freedom has mean k, variance 2k */
+        double z = (chi2 - dof) / sqrt(2 * dof);
+        report(1, "Shuffle uniformity: chi-square = %.2f, dof = %.0f, z = %.2f",
+               chi2, dof, z);
+        if (z > 6)
+            report(1, "Warning: Shuffle distribution looks non-uniform");
+    }
+
+    free(index);
+    free(counts);
+    free(widths);
+    return ok;
+}
+
+static bool do_shuffle(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int reps = 1;
+    bool ok = true;
+    if (argc == 2) {
+        if (!get_int(argv[1], &reps) || reps < 1) {
+            report(1, "Invalid number of shuffles '%s'", argv[1]);
+            return false;
+        }
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling shuffle on null queue");
+        return false;
+    }
+    error_check();
+
+    if (shuffle_buckets > 0 && current->size >= 2) {
+        size_t nb = shuffle_buckets;
+        if (nb < 2 || nb > (size_t) current->size) {
+            report(1, "Number of buckets must be between 2 and %d",
+                   current->size);
+            return false;
+        }
+        ok = shuffle_stats(reps, nb);
+    } else if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (!q_shuffle(current->q)) {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Shuffle failed");
+                else {
+                    report(1, "ERROR: Shuffle failed (%d failures total)",
+                           fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    if (ok) {
+        int expected_size = current->size;
+        int actual_size = q_size(current->q);
+
+        if (expected_size != actual_size) {
+            report(1,
+                   "ERROR: Queue size mismatch after shuffle. Expected: %d, "
+                   "Got: %d",
+                   expected_size, actual_size);
+            ok = false;
+        }
+    }
+
+    q_show(3);
+
+    return ok && !error_check();
+}
 
 static bool is_circular()
 {
-    struct list_head *cur = current->q->next;
+    struct list_head *cur = qlist()->next;
     struct list_head *fast = (cur) ? cur->next : NULL;
     while (cur != current->q) {
         if (!cur || !fast || !fast->next)
@@ -1054,6 +1554,28 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        memstat_reset();
+        return true;
+    }
+    if (argc == 3 && !strcmp(argv[1], "dump")) {
+        if (!memstat_dump(argv[2])) {
+            report(1, "ERROR: Could not write statistics to '%s'", argv[2]);
+            return false;
+        }
+        return true;
+    }
+    if (argc != 1) {
+        report(1, "%s takes no arguments, 'reset' or 'dump FILE'", argv[0]);
+        return false;
+    }
+
+    memstat_show(1);
+    return true;
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1100,9 +1622,59 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+static void set_allocator(int oldval)
+{
+    if (allocator_mode != ALLOCATOR_MALLOC &&
+        allocator_mode != ALLOCATOR_SLAB) {
+        report(1, "ERROR: Allocator must be %d or %d", ALLOCATOR_MALLOC,
+               ALLOCATOR_SLAB);
+        allocator_mode = oldval;
+    }
+}
+
+static void set_sort_threads(int oldval)
+{
+    int threads = q_sort_threads(sort_threads);
+    if (threads != sort_threads) {
+        report(1, "Warning: Number of threads clamped to %d", threads);
+        sort_threads = threads;
+    }
+}
+
+static void set_sort_mode(int oldval)
+{
+    if (sort_mode < SORT_AUTO || sort_mode > SORT_ADAPTIVE) {
+        report(1, "ERROR: Sort mode must be between %d and %d", SORT_AUTO,
+               SORT_ADAPTIVE);
+        sort_mode = oldval;
+    }
+    q_sort_mode(sort_mode);
+}
+
+static void set_order(int oldval)
+{
+    int count = sizeof(orders) / sizeof(orders[0]);
+    if (order_index < 0 || order_index >= count) {
+        report(1, "ERROR: Order must be between 0 and %d", count - 1);
+        order_index = oldval;
+    }
+    q_set_order(orders[order_index]);
+}
+
+/* Counters for option profile: allocations, and the size of the queue */
+static void sample_counters(cmd_counters_t *counters)
+{
+    counters->allocs = allocation_total();
+    if (current && current->q)
+        counters->elements = q_size(current->q);
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "Create new queue", "");
+    ADD_COMMAND(new,
+                "Create new queue, kept in a ring of pointers with ring, or in "
+                "chunks of them with unrolled",
+                "[ring|unrolled]");
     ADD_COMMAND(free, "Delete queue", "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
@@ -1114,6 +1686,16 @@ static void console_init()
                 "Insert string str at tail of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
                 "str [n]");
+    ADD_COMMAND(ihb,
+                "Insert string str at head of queue n times, in batches. "
+                "Generate random string(s) if str equals RAND. (default: n "
+                "== 1)",
+                "str [n]");
+    ADD_COMMAND(itb,
+                "Insert string str at tail of queue n times, in batches. "
+                "Generate random string(s) if str equals RAND. (default: n "
+                "== 1)",
+                "str [n]");
     ADD_COMMAND(
         rh,
         "Remove from head of queue. Optionally compare to expected value str",
@@ -1122,15 +1704,27 @@ static void console_init()
         rt,
         "Remove from tail of queue. Optionally compare to expected value str",
         "[str]");
+    ADD_COMMAND(rhb, "Remove n elements from head of queue in one batch",
+                "[n]");
+    ADD_COMMAND(rtb, "Remove n elements from tail of queue in one batch",
+                "[n]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descending order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(memstat,
+                "Show allocations by call site and size class, reset the "
+                "counts, or write them as CSV",
+                "[reset|dump FILE]");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
-    ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
+    ADD_COMMAND(dedup,
+                "Delete all nodes that have duplicate string, adjacent only or "
+                "anywhere in the queue with 'all'",
+                "[all]");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
-    // ADD_COMMAND(shuffle, "Shuffle the nodes in queue", "");
+    ADD_COMMAND(shuffle, "Shuffle the nodes in queue n times (default: n == 1)",
+                "[n]");
     ADD_COMMAND(ascend,
                 "Remove every node which has a node with a strictly less "
                 "value anywhere to the right side of it",
@@ -1145,10 +1739,27 @@ static void console_init()
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("allocator", &allocator_mode,
+              "Block allocator (0: malloc, 1: slab)", set_allocator);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("threads", &sort_threads, "Number of threads used by sort",
+              set_sort_threads);
+    add_param(
+        "sortmode", &sort_mode,
+        "Sort algorithm (0: auto, 1: list, 2: array, 3: radix, 4: adaptive)",
+        set_sort_mode);
+    add_param("move", &move_insert,
+              "Hand strings over to q_insert_*_move in ih and it", NULL);
+    add_param("order", &order_index,
+              "Element order (0: string, 1: numeric, 2: nocase, 3: length)",
+              set_order);
+    add_param("uniform", &shuffle_buckets,
+              "Buckets for shuffle uniformity test (0: disabled)", NULL);
+    set_cmd_counters(sample_counters);
+    bench_init();
 }
 
 /* Signal handlers */
@@ -1181,8 +1792,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1196,7 +1805,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
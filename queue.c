@@ -1,23 +1,616 @@
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strcasecmp */
 
 #include "queue.h"
+#include "random.h"
+
+/* Get the queue_t owning the list head handed out by q_new() */
+static inline queue_t *queue_of(struct list_head *head)
+{
+    return list_entry(head, queue_t, head);
+}
+
+/* Element orders */
+/* First 8 bytes of s as a big-endian integer, zero padded past its end */
+static inline uint64_t key_prefix(const char *s)
+{
+    uint64_t key = 0;
+
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*s) {
+            key |= (unsigned char) *s++;
+        }
+    }
+    return key;
+}
+
+static uint64_t string_key(uint64_t prefix, size_t len, const char *s)
+{
+    return prefix;
+}
+
+static int numeric_cmp(const char *a, const char *b)
+{
+    long long x = strtoll(a, NULL, 10), y = strtoll(b, NULL, 10);
+
+    if (x != y) {
+        return x < y ? -1 : 1;
+    }
+    return strcmp(a, b);
+}
+
+static uint64_t numeric_key(uint64_t prefix, size_t len, const char *s)
+{
+    /* Flipping the sign bit maps signed order onto unsigned order */
+    return (uint64_t) strtoll(s, NULL, 10) ^ (1ULL << 63);
+}
+
+static uint64_t nocase_key(uint64_t prefix, size_t len, const char *s)
+{
+    uint64_t key = 0;
+
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        key = key << 8 | (unsigned char) tolower((prefix >> shift) & 0xff);
+    }
+    return key;
+}
+
+static int length_cmp(const char *a, const char *b)
+{
+    size_t len_a = strlen(a), len_b = strlen(b);
+
+    if (len_a != len_b) {
+        return len_a < len_b ? -1 : 1;
+    }
+    return strcmp(a, b);
+}
+
+static uint64_t length_key(uint64_t prefix, size_t len, const char *s)
+{
+    /* Lengths that do not fit tie, and are left to length_cmp() */
+    if (len > UINT32_MAX) {
+        len = UINT32_MAX;
+    }
+    return (uint64_t) len << 32 | prefix >> 32;
+}
+
+/* 64-bit FNV-1a */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t string_hash(const char *s)
+{
+    uint64_t hash = FNV_OFFSET;
+
+    while (*s) {
+        hash = (hash ^ (unsigned char) *s++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t nocase_hash(const char *s)
+{
+    uint64_t hash = FNV_OFFSET;
+
+    while (*s) {
+        hash = (hash ^ (unsigned char) tolower((unsigned char) *s++)) *
+               FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Numeric and length orders break ties by byte order, so only identical
+ * strings are equal in them and string_hash() serves
+ */
+const queue_order_t q_order_string = {"string", strcmp, string_key, false,
+                                      string_hash};
+const queue_order_t q_order_numeric = {"numeric", numeric_cmp, numeric_key,
+                                       true, string_hash};
+const queue_order_t q_order_nocase = {"nocase", strcasecmp, nocase_key, false,
+                                      nocase_hash};
+const queue_order_t q_order_length = {"length", length_cmp, length_key, false,
+                                      string_hash};
+
+static const queue_order_t *order = &q_order_string;
+
+void q_set_order(const queue_order_t *new_order)
+{
+    order = new_order ? new_order : &q_order_string;
+}
+
+int q_compare(const char *a, const char *b)
+{
+    return order->cmp(a, b);
+}
+
+static inline uint64_t element_key(const queue_order_t *ord,
+                                   const element_t *e)
+{
+#if ELEMENT_KEY_CACHE
+    return ord->key(e->prefix, e->len, e->value);
+#else
+    return ord->key(key_prefix(e->value), strlen(e->value), e->value);
+#endif
+}
+
+/* Compare two elements in order ord.  With ELEMENT_KEY_CACHE most pairs are
+ * settled by their cached keys, without touching the strings.
+ */
+static inline int element_cmp(const queue_order_t *ord,
+                              const element_t *a,
+                              const element_t *b)
+{
+#if ELEMENT_KEY_CACHE
+    if (ord == &q_order_string) {
+        if (a->prefix != b->prefix) {
+            return a->prefix < b->prefix ? -1 : 1;
+        }
+        /* A zero last byte means both strings ended inside the prefix */
+        if (!(a->prefix & 0xff)) {
+            return 0;
+        }
+        return strcmp(a->value + 8, b->value + 8);
+    }
+    if (!ord->key_needs_string) {
+        uint64_t key_a = element_key(ord, a), key_b = element_key(ord, b);
+        if (key_a != key_b) {
+            return key_a < key_b ? -1 : 1;
+        }
+    }
+#endif
+    return ord->cmp(a->value, b->value);
+}
+
+/* Ring queues */
+#define RING_MIN_SLOTS 16
+
+/* Slot of the i-th element of a ring queue */
+static inline element_t **ring_slot(queue_t *q, int i)
+{
+    return &q->ring[(q->ring_first + i) & q->ring_mask];
+}
+
+/* Swap the i-th and the j-th elements of a ring queue */
+static inline void ring_exchange(queue_t *q, int i, int j)
+{
+    element_t **a = ring_slot(q, i), **b = ring_slot(q, j), *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Reverse the elements from the lo-th up to, not including, the hi-th */
+static void ring_reverse(queue_t *q, int lo, int hi)
+{
+    while (lo < --hi) {
+        ring_exchange(q, lo++, hi);
+    }
+    q->linked = false;
+}
+
+/* Thread the list through the elements of the ring, in queue order */
+static void ring_link(queue_t *q)
+{
+    struct list_head *prev = &q->head;
+
+    for (int i = 0; i < q->size; i++) {
+        struct list_head *node = &(*ring_slot(q, i))->list;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+    q->linked = true;
+}
+
+/* Fill the ring back from the list, if it has room for every element */
+static bool ring_reload(queue_t *q)
+{
+    if ((unsigned) q->size > q->ring_mask + 1) {
+        return false;
+    }
+
+    element_t *e;
+    int i = 0;
+    list_for_each_entry (e, &q->head, list)
+        q->ring[i++] = e;
+    q->ring_first = 0;
+    q->linked = true;
+    q->listed = false;
+    return true;
+}
+
+/* The queue of head if its elements are in a ring, NULL to use the list */
+static queue_t *ring_of(struct list_head *head)
+{
+    queue_t *q = queue_of(head);
+
+    if (!q->ring || (q->listed && !ring_reload(q))) {
+        return NULL;
+    }
+    return q;
+}
+
+/* Make room in the ring for n more elements, doubling it as needed, and
+ * take the elements back from the list if they are there
+ */
+static bool ring_reserve(queue_t *q, int n)
+{
+    size_t need = (size_t) q->size + n, slots = q->ring_mask + 1;
+
+    if (need > slots) {
+        if (need > UINT_MAX / sizeof(element_t *)) {
+            return false;
+        }
+        while (slots < need) {
+            slots <<= 1;
+        }
+        element_t **ring = malloc(slots * sizeof(element_t *));
+        if (!ring) {
+            return false;
+        }
+        if (!q->listed) {
+            for (int i = 0; i < q->size; i++) {
+                ring[i] = *ring_slot(q, i);
+            }
+        }
+        free(q->ring);
+        q->ring = ring;
+        q->ring_mask = slots - 1;
+        q->ring_first = 0;
+    }
+    return !q->listed || ring_reload(q);
+}
+
+/* Put e at the head or the tail of a ring queue with a free slot */
+static void ring_push(queue_t *q, element_t *e, bool tail)
+{
+    if (tail) {
+        *ring_slot(q, q->size) = e;
+        if (q->linked) {
+            list_add_tail(&e->list, &q->head);
+        }
+    } else {
+        q->ring_first = (q->ring_first - 1) & q->ring_mask;
+        q->ring[q->ring_first] = e;
+        if (q->linked) {
+            list_add(&e->list, &q->head);
+        }
+    }
+    q->size++;
+}
+
+/* Take the element at the head or the tail off a non-empty ring queue */
+static element_t *ring_pop(queue_t *q, bool tail)
+{
+    element_t *e = *ring_slot(q, tail ? q->size - 1 : 0);
+
+    if (!tail) {
+        q->ring_first = (q->ring_first + 1) & q->ring_mask;
+    }
+    q->size--;
+    if (q->linked) {
+        list_del_init(&e->list);
+    }
+    return e;
+}
+
+/* Unrolled queues */
+#define CHUNK_SLOTS 13
+
+/* Run of up to CHUNK_SLOTS elements of an unrolled queue, from slots[first]
+ * to slots[first + count - 1]; 128 bytes on 64-bit targets
+ */
+typedef struct {
+    struct list_head link;
+    uint16_t first, count;
+    element_t *slots[CHUNK_SLOTS];
+} queue_chunk_t;
+
+static inline queue_chunk_t *chunk_of(struct list_head *link)
+{
+    return list_entry(link, queue_chunk_t, link);
+}
+
+/* Free slots at the head or the tail end of an unrolled queue */
+static int chunk_room(queue_t *q, bool tail)
+{
+    if (list_empty(&q->chunks)) {
+        return 0;
+    }
+
+    queue_chunk_t *c = chunk_of(tail ? q->chunks.prev : q->chunks.next);
+    return tail ? CHUNK_SLOTS - c->first - c->count : c->first;
+}
+
+/* Retire a chunk that has become empty.  One is kept as a spare, so that a
+ * queue going back and forth across a chunk boundary does not allocate.
+ */
+static void chunk_close(queue_t *q, queue_chunk_t *c)
+{
+    if (list_empty(&q->spare)) {
+        list_move(&c->link, &q->spare);
+    } else {
+        list_del(&c->link);
+        free(c);
+    }
+}
+
+/* Make sure n more elements fit at the head or the tail, stocking the spares
+ * so that placing them does not allocate
+ */
+static bool chunks_reserve(queue_t *q, int n, bool tail)
+{
+    int room = chunk_room(q, tail);
+    struct list_head *node;
+
+    list_for_each (node, &q->spare)
+        room += CHUNK_SLOTS;
+    while (room < n) {
+        queue_chunk_t *c = malloc(sizeof(queue_chunk_t));
+        if (!c) {
+            return false;
+        }
+        list_add(&c->link, &q->spare);
+        room += CHUNK_SLOTS;
+    }
+    return true;
+}
+
+/* Place e at the head or the tail of the chunks, with room reserved */
+static void chunk_put(queue_t *q, element_t *e, bool tail)
+{
+    if (!chunk_room(q, tail)) {
+        queue_chunk_t *c = chunk_of(q->spare.next);
+        if (tail) {
+            list_move_tail(&c->link, &q->chunks);
+        } else {
+            list_move(&c->link, &q->chunks);
+        }
+        c->first = tail ? 0 : CHUNK_SLOTS;
+        c->count = 0;
+    }
+
+    queue_chunk_t *c = chunk_of(tail ? q->chunks.prev : q->chunks.next);
+    if (tail) {
+        c->slots[c->first + c->count] = e;
+    } else {
+        c->slots[--c->first] = e;
+    }
+    c->count++;
+}
+
+/* Thread the list through the elements of the chunks, in queue order */
+static void chunks_link(queue_t *q)
+{
+    struct list_head *prev = &q->head;
+    queue_chunk_t *c;
+
+    list_for_each_entry (c, &q->chunks, link) {
+        for (int i = c->first; i < c->first + c->count; i++) {
+            struct list_head *node = &c->slots[i]->list;
+            prev->next = node;
+            node->prev = prev;
+            prev = node;
+        }
+    }
+    prev->next = &q->head;
+    q->head.prev = prev;
+    q->linked = true;
+}
+
+/* Pack the elements of the list back into chunks */
+static bool chunks_reload(queue_t *q)
+{
+    list_splice_init(&q->chunks, &q->spare);
+    if (!chunks_reserve(q, q->size, true)) {
+        return false;
+    }
+
+    element_t *e;
+    list_for_each_entry (e, &q->head, list)
+        chunk_put(q, e, true);
+    while (!list_is_singular(&q->spare) && !list_empty(&q->spare)) {
+        queue_chunk_t *c = chunk_of(q->spare.next);
+        list_del(&c->link);
+        free(c);
+    }
+    q->linked = true;
+    q->listed = false;
+    return true;
+}
+
+/* The queue of head if its elements are in chunks, NULL to use the list */
+static queue_t *chunks_of(struct list_head *head)
+{
+    queue_t *q = queue_of(head);
+
+    if (!q->unrolled || (q->listed && !chunks_reload(q))) {
+        return NULL;
+    }
+    return q;
+}
+
+static void chunks_push(queue_t *q, element_t *e, bool tail)
+{
+    chunk_put(q, e, tail);
+    q->size++;
+    if (q->linked) {
+        if (tail) {
+            list_add_tail(&e->list, &q->head);
+        } else {
+            list_add(&e->list, &q->head);
+        }
+    }
+}
+
+static element_t *chunks_pop(queue_t *q, bool tail)
+{
+    queue_chunk_t *c = chunk_of(tail ? q->chunks.prev : q->chunks.next);
+    element_t *e = tail ? c->slots[c->first + c->count - 1]
+                        : c->slots[c->first++];
+
+    if (!--c->count) {
+        chunk_close(q, c);
+    }
+    q->size--;
+    if (q->linked) {
+        list_del_init(&e->list);
+    }
+    return e;
+}
+
+/* Delete every element that has one comparing strictly less, after
+ * multiplying the result by sign, somewhere to its right.  Chunks are
+ * walked from the tail, and the survivors are packed towards the tail as
+ * they are found, which only ever writes slots that have been read.
+ */
+static int chunks_filter(queue_t *q, int sign)
+{
+    queue_chunk_t *w = chunk_of(q->chunks.prev), *c;
+    const element_t *best = NULL;
+    int wi = CHUNK_SLOTS;
+
+    for (c = w; &c->link != &q->chunks; c = chunk_of(c->link.prev)) {
+        for (int i = c->first + c->count - 1; i >= c->first; i--) {
+            element_t *e = c->slots[i];
+            int cmp = best ? sign * element_cmp(order, e, best) : -1;
+            if (cmp > 0) {
+                q_release_element(e);
+                q->size--;
+                continue;
+            }
+            if (cmp < 0) {
+                best = e;
+            }
+            /* The writer is never behind the reader, so w != c here */
+            if (!wi) {
+                w->first = 0;
+                w->count = CHUNK_SLOTS;
+                w = chunk_of(w->link.prev);
+                wi = CHUNK_SLOTS;
+            }
+            w->slots[--wi] = e;
+        }
+    }
+
+    while (q->chunks.next != &w->link) {
+        chunk_close(q, chunk_of(q->chunks.next));
+    }
+    w->first = wi;
+    w->count = CHUNK_SLOTS - wi;
+    if (!w->count) {
+        chunk_close(q, w);
+    }
+    q->linked = false;
+    return q->size;
+}
+
+/* Thread the list of a ring or unrolled queue */
+static void queue_link(queue_t *q)
+{
+    if (q->ring) {
+        ring_link(q);
+    } else {
+        chunks_link(q);
+    }
+}
+
+/* Hand the elements of a ring or unrolled queue over to its list, for the
+ * operations that have no version of their own; the next one that has
+ * takes them back
+ */
+static void queue_to_list(struct list_head *head)
+{
+    if (!head) {
+        return;
+    }
+
+    queue_t *q = queue_of(head);
+    if (!q->listed) {
+        if (!q->linked) {
+            queue_link(q);
+        }
+        q->listed = true;
+    }
+}
 
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *new_queue = malloc(sizeof(struct list_head));
+    queue_t *new_queue = malloc(sizeof(queue_t));
 
     /* check malloc */
     if (!new_queue) {
         return NULL;
     }
 
-    INIT_LIST_HEAD(new_queue);
-    return new_queue;
+    INIT_LIST_HEAD(&new_queue->head);
+    new_queue->size = 0;
+    new_queue->ring = NULL;
+    new_queue->unrolled = false;
+    new_queue->linked = true;
+    new_queue->listed = true;
+    return &new_queue->head;
+}
+
+/* Create an empty ring queue */
+struct list_head *q_new_ring()
+{
+    struct list_head *head = q_new();
+
+    if (!head) {
+        return NULL;
+    }
+
+    queue_t *q = queue_of(head);
+    q->ring = malloc(RING_MIN_SLOTS * sizeof(element_t *));
+    if (!q->ring) {
+        free(q);
+        return NULL;
+    }
+    q->ring_mask = RING_MIN_SLOTS - 1;
+    q->ring_first = 0;
+    q->listed = false;
+    return head;
 }
 
+/* Create an empty unrolled queue */
+struct list_head *q_new_unrolled()
+{
+    struct list_head *head = q_new();
+
+    if (!head) {
+        return NULL;
+    }
+
+    queue_t *q = queue_of(head);
+    INIT_LIST_HEAD(&q->chunks);
+    INIT_LIST_HEAD(&q->spare);
+    q->unrolled = true;
+    q->listed = false;
+    return head;
+}
+
+void q_link(struct list_head *head)
+{
+    if (!head) {
+        return;
+    }
+
+    queue_t *q = queue_of(head);
+    if (!q->listed && !q->linked) {
+        queue_link(q);
+    }
+}
 
 /* Free all storage used by queue */
 void q_free(struct list_head *head)
@@ -26,75 +619,259 @@ void q_free(struct list_head *head)
         return;
     }
 
+    queue_t *q = queue_of(head);
+    if (!q->listed && !q->linked) {
+        queue_link(q);
+    }
+
     struct list_head *node, *safe;
 
-    list_for_each_safe (node, safe, head) {
-        free(list_entry(node, element_t, list)->value);
-        free(list_entry(node, element_t, list));
+    list_for_each_safe (node, safe, head)
+        q_release_element(list_entry(node, element_t, list));
+    if (q->unrolled) {
+        list_splice(&q->chunks, &q->spare);
+        list_for_each_safe (node, safe, &q->spare)
+            free(chunk_of(node));
     }
-    free(head);
+    free(q->ring);
+    free(q);
 }
 
 
+/* Finish an element whose value is set */
+static inline void element_init(element_t *e)
+{
+#if ELEMENT_KEY_CACHE
+    size_t len = strlen(e->value);
+    e->prefix = key_prefix(e->value);
+    e->len = len < UINT32_MAX ? len : UINT32_MAX;
+#endif
+    INIT_LIST_HEAD(&e->list);
+}
+
+/* Allocate an element holding a copy of s, inline when it is short enough */
+static element_t *element_new(const char *s)
+{
+    size_t len = strlen(s);
+    element_t *e;
+
+    if (len <= ELEMENT_INLINE_LEN) {
+        e = malloc(sizeof(element_t) + len + 1);
+        if (!e) {
+            return NULL;
+        }
+        e->value = memcpy(e->inline_value, s, len + 1);
+    } else {
+        e = malloc(sizeof(element_t));
+        if (!e) {
+            return NULL;
+        }
+        e->value = strdup(s);
+        if (!e->value) {
+            free(e);
+            return NULL;
+        }
+    }
+
+    element_init(e);
+    return e;
+}
+
+/* Allocate an element taking over s, which must come from malloc() */
+static element_t *element_adopt(char *s)
+{
+    element_t *e = malloc(sizeof(element_t));
+
+    if (!e) {
+        return NULL;
+    }
+    e->value = s;
+    element_init(e);
+    return e;
+}
+
+/* Make room for n more elements at the head or the tail, which only a ring
+ * or unrolled queue may lack
+ */
+static inline bool queue_reserve(struct list_head *head, int n, bool tail)
+{
+    queue_t *q = queue_of(head);
+
+    if (q->unrolled) {
+        return (!q->listed || chunks_reload(q)) &&
+               chunks_reserve(q, n, tail);
+    }
+    return !q->ring || ring_reserve(q, n);
+}
+
+/* Add e at the head or the tail of a queue with room for it */
+static inline void queue_add(struct list_head *head, element_t *e, bool tail)
+{
+    queue_t *q = queue_of(head);
+
+    if (q->ring) {
+        ring_push(q, e, tail);
+        return;
+    }
+    if (q->unrolled) {
+        chunks_push(q, e, tail);
+        return;
+    }
+    if (tail) {
+        list_add_tail(&e->list, head);
+    } else {
+        list_add(&e->list, head);
+    }
+    q->size++;
+}
+
 /* Insert an element at head of queue */
 bool q_insert_head(struct list_head *head, char *s)
 {
-    if (!head || !s) {
+    if (!head || !s || !queue_reserve(head, 1, false)) {
         return false;
     }
 
-    element_t *new_content = malloc(sizeof(element_t));
+    element_t *new_content = element_new(s);
 
     if (!new_content) {
         return false;
     }
 
-    INIT_LIST_HEAD(&new_content->list);
-    new_content->value = strdup(s);
+    queue_add(head, new_content, false);
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head || !s || !queue_reserve(head, 1, true)) {
+        return false;
+    }
+
+    element_t *new_content = element_new(s);
 
-    if (!new_content->value) {
-        free(new_content);
+    if (!new_content) {
         return false;
     }
 
-    list_add(&new_content->list, head);
+    queue_add(head, new_content, true);
     return true;
 }
 
-/* Insert an element at tail of queue */
-bool q_insert_tail(struct list_head *head, char *s)
+/* Insert an element at head of queue, taking over s */
+bool q_insert_head_move(struct list_head *head, char *s)
 {
-    if (!head || !s) {
+    if (!head || !s || !queue_reserve(head, 1, false)) {
         return false;
     }
 
-    element_t *new_content = malloc(sizeof(element_t));
+    element_t *e = element_adopt(s);
 
-    if (!new_content) {
+    if (!e) {
         return false;
     }
 
-    INIT_LIST_HEAD(&new_content->list);
-    new_content->value = strdup(s);
+    queue_add(head, e, false);
+    return true;
+}
+
+/* Insert an element at tail of queue, taking over s */
+bool q_insert_tail_move(struct list_head *head, char *s)
+{
+    if (!head || !s || !queue_reserve(head, 1, true)) {
+        return false;
+    }
 
-    if (!new_content->value) {
-        free(new_content);
+    element_t *e = element_adopt(s);
+
+    if (!e) {
         return false;
     }
 
-    list_add_tail(&new_content->list, head);
+    queue_add(head, e, true);
     return true;
 }
 
+/* Insert a batch of elements, spliced in at once */
+bool q_insert_bulk(struct list_head *head, char *const strings[], int n,
+                   bool tail)
+{
+    if (!head || n < 0 || (n > 0 && !strings) ||
+        !queue_reserve(head, n, tail)) {
+        return false;
+    }
+
+    LIST_HEAD(batch);
+    for (int i = 0; i < n; i++) {
+        element_t *e = strings[i] ? element_new(strings[i]) : NULL;
+        if (!e) {
+            struct list_head *node, *safe;
+            list_for_each_safe (node, safe, &batch)
+                q_release_element(list_entry(node, element_t, list));
+            return false;
+        }
+        list_add_tail(&e->list, &batch);
+    }
+
+    queue_t *q = queue_of(head);
+    if (q->ring) {
+        element_t *e;
+        int i = tail ? q->size : 0;
+        if (!tail) {
+            q->ring_first = (q->ring_first - n) & q->ring_mask;
+        }
+        list_for_each_entry (e, &batch, list)
+            *ring_slot(q, i++) = e;
+    } else if (q->unrolled) {
+        struct list_head *node;
+        if (tail) {
+            list_for_each (node, &batch)
+                chunk_put(q, list_entry(node, element_t, list), true);
+        } else {
+            for (node = batch.prev; node != &batch; node = node->prev)
+                chunk_put(q, list_entry(node, element_t, list), false);
+        }
+    }
+
+    if (q->linked) {
+        if (tail) {
+            list_splice_tail(&batch, head);
+        } else {
+            list_splice(&batch, head);
+        }
+    }
+    q->size += n;
+    return true;
+}
+
+/* Take the element at the head or the tail off a non-empty queue */
+static element_t *queue_pop(struct list_head *head, bool tail)
+{
+    queue_t *q = ring_of(head);
+
+    if (q) {
+        return ring_pop(q, tail);
+    }
+    if ((q = chunks_of(head))) {
+        return chunks_pop(q, tail);
+    }
+
+    element_t *e = tail ? list_last_entry(head, element_t, list)
+                        : list_first_entry(head, element_t, list);
+    list_del(&e->list);
+    queue_of(head)->size--;
+    return e;
+}
+
 /* Remove an element from head of queue */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
         return NULL;
     }
 
-    element_t *first = list_first_entry(head, element_t, list);
-    list_del(&first->list);
+    element_t *first = queue_pop(head, false);
 
     if (!sp) {
         return first;
@@ -112,12 +889,11 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 /* Remove an element from tail of queue */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
         return NULL;
     }
 
-    element_t *tail = list_last_entry(head, element_t, list);
-    list_del(&tail->list);
+    element_t *tail = queue_pop(head, true);
 
     if (!sp) {
         return tail;
@@ -132,50 +908,236 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
     return tail;
 }
 
+/* Remove up to n elements from the head or the tail as one segment */
+int q_remove_bulk(struct list_head *head, struct list_head *out, int n,
+                  bool tail, char *sp, size_t bufsize)
+{
+    if (!head || !out || n <= 0 || !q_size(head)) {
+        return 0;
+    }
+
+    int size = q_size(head);
+    if (n > size) {
+        n = size;
+    }
+
+    int front = tail ? size - n : n;
+    queue_t *q = ring_of(head);
+    LIST_HEAD(removed);
+
+    if (!q && chunks_of(head)) {
+        /* Pop them off the chunks, keeping queue order */
+        for (int i = 0; i < n; i++) {
+            element_t *e = queue_pop(head, tail);
+            if (tail) {
+                list_add(&e->list, &removed);
+            } else {
+                list_add_tail(&e->list, &removed);
+            }
+        }
+    } else if (q && !q->linked) {
+        /* Link up only the elements leaving the ring */
+        for (int i = tail ? front : 0; i < (tail ? size : n); i++) {
+            list_add_tail(&(*ring_slot(q, i))->list, &removed);
+        }
+        q->size -= n;
+    } else {
+        /* Find the last node of the part that stays in front, straight from
+         * the ring or walking from the nearer end of the list
+         */
+        struct list_head *cut = head;
+        if (q) {
+            cut = front ? &(*ring_slot(q, front - 1))->list : head;
+        } else if (front <= size / 2) {
+            for (int i = 0; i < front; i++) {
+                cut = cut->next;
+            }
+        } else {
+            for (int i = size; i >= front; i--) {
+                cut = cut->prev;
+            }
+        }
+
+        if (tail) {
+            LIST_HEAD(kept);
+            list_cut_position(&kept, head, cut);
+            list_splice_init(head, &removed);
+            list_splice(&kept, head);
+        } else {
+            list_cut_position(&removed, head, cut);
+        }
+        queue_of(head)->size -= n;
+    }
+    if (q && !tail) {
+        q->ring_first = (q->ring_first + n) & q->ring_mask;
+    }
+
+    if (sp && bufsize) {
+        element_t *e;
+        size_t used = 0;
+        list_for_each_entry (e, &removed, list) {
+            size_t len = strlen(e->value);
+            if (len > bufsize - used - 1) {
+                len = bufsize - used - 1;
+            }
+            memcpy(sp + used, e->value, len);
+            sp[used + len] = '\0';
+            used += len + 1;
+            if (used == bufsize) {
+                break;
+            }
+        }
+    }
+
+    list_splice_tail(&removed, out);
+    return n;
+}
+
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
 
-    int len = 0;
-    struct list_head *li;
+    return queue_of(head)->size;
+}
+
+/* State of the splitmix generator driving q_shuffle(), seeded on first use */
+static uintptr_t shuffle_state;
 
-    list_for_each (li, head)
-        len++;
-    return len;
+static inline uintptr_t shuffle_next(void)
+{
+    if (!shuffle_state)
+        randombytes((uint8_t *) &shuffle_state, sizeof(shuffle_state));
+    shuffle_state += (uintptr_t) 0x9e3779b97f4a7c15ULL;
+    return random_shuffle(shuffle_state);
+}
+
+/* Return an unbiased random integer in [0, bound) */
+static uintptr_t shuffle_rand(uintptr_t bound)
+{
+    /* Reject the low values that would make the modulo favor small results */
+    uintptr_t threshold = -bound % bound;
+    uintptr_t r;
+    do {
+        r = shuffle_next();
+    } while (r < threshold);
+    return r % bound;
+}
+
+/* Pack the elements of an unrolled queue into full chunks from the head, so
+ * that the i-th one sits in slots[i % CHUNK_SLOTS] of table[i / CHUNK_SLOTS].
+ * Elements only move towards the head, into slots that have been read.
+ */
+static void chunks_pack(queue_t *q, queue_chunk_t **table)
+{
+    queue_chunk_t *w = chunk_of(q->chunks.next), *c;
+    int wi = 0, n = 0;
+
+    table[n++] = w;
+    list_for_each_entry (c, &q->chunks, link) {
+        int end = c->first + c->count;
+        for (int i = c->first; i < end; i++) {
+            /* The reader is already past a full writer, so w != c here */
+            if (wi == CHUNK_SLOTS) {
+                w->first = 0;
+                w->count = CHUNK_SLOTS;
+                w = chunk_of(w->link.next);
+                table[n++] = w;
+                wi = 0;
+            }
+            w->slots[wi++] = c->slots[i];
+        }
+    }
+
+    while (q->chunks.prev != &w->link) {
+        chunk_close(q, chunk_of(q->chunks.prev));
+    }
+    w->first = 0;
+    w->count = wi;
 }
 
 /* Shuffle the node in the queue*/
-void q_shuffle(struct list_head *head)
+bool q_shuffle(struct list_head *head)
 {
-    int len = q_size(head);
+    if (!head) {
+        return false;
+    }
 
+    int len = q_size(head);
     if (len <= 1) {
-        return;
+        return true;
     }
 
-    for (int remain = len; remain > 0; remain--) {
-        int rand_num = rand() % remain;
+    queue_t *q = ring_of(head);
+    if (q) {
+        /* Fisher-Yates right on the ring, which needs no scratch array */
+        for (int i = len - 1; i > 0; i--) {
+            ring_exchange(q, i, shuffle_rand(i + 1));
+        }
+        q->linked = false;
+        return true;
+    }
 
-        struct list_head *node;
+    if ((q = chunks_of(head))) {
+        /* Fisher-Yates on the slots, found through a table of the chunks */
+        int nchunks = (len + CHUNK_SLOTS - 1) / CHUNK_SLOTS;
+        queue_chunk_t **table = malloc(nchunks * sizeof(queue_chunk_t *));
+        if (!table) {
+            return false;
+        }
 
-        list_for_each (node, head) {
-            if (rand_num == 0) {
-                break;
-            }
-            rand_num--;
+        chunks_pack(q, table);
+        for (int i = len - 1; i > 0; i--) {
+            int j = shuffle_rand(i + 1);
+            element_t **a = &table[i / CHUNK_SLOTS]->slots[i % CHUNK_SLOTS];
+            element_t **b = &table[j / CHUNK_SLOTS]->slots[j % CHUNK_SLOTS];
+            element_t *tmp = *a;
+            *a = *b;
+            *b = tmp;
         }
+        q->linked = false;
+        free(table);
+        return true;
+    }
+    queue_to_list(head);
+
+    struct list_head **nodes = malloc(len * sizeof(struct list_head *));
+    if (!nodes) {
+        return false;
+    }
 
-        list_del(node);
-        list_add_tail(node, head);
+    /* Fisher-Yates over an array of the nodes, then relink them in order */
+    struct list_head *node;
+    int i = 0;
+    list_for_each (node, head)
+        nodes[i++] = node;
+
+    for (i = len - 1; i > 0; i--) {
+        int j = shuffle_rand(i + 1);
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
     }
+
+    struct list_head *prev = head;
+    for (i = 0; i < len; i++) {
+        prev->next = nodes[i];
+        nodes[i]->prev = prev;
+        prev = nodes[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+
+    free(nodes);
+    return true;
 }
 
 /* Delete the middle node in queue */
 bool q_delete_mid(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
+    queue_to_list(head);
     if (!head || list_empty(head))
         return false;
     struct list_head *fast = head->next;
@@ -186,8 +1148,8 @@ bool q_delete_mid(struct list_head *head)
     }
     element_t *mid = list_entry(slow, element_t, list);
     list_del(slow);
-    free(mid->value);
-    free(mid);
+    q_release_element(mid);
+    queue_of(head)->size--;
     return true;
 }
 
@@ -196,29 +1158,105 @@ bool q_delete_mid(struct list_head *head)
 bool q_delete_dup(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
+    queue_to_list(head);
     if (!head || list_empty(head)) {
         return false;
     }
 
     struct list_head *node, *safe;
     bool dup = false;
+    int removed = 0;
 
     list_for_each_safe (node, safe, head) {
         element_t *first = list_entry(node, element_t, list);
         const element_t *second = list_entry(safe, element_t, list);
-        if (safe != head && !strcmp(first->value, second->value)) {
+        if (safe != head && !element_cmp(order, first, second)) {
             list_del(node);
-            free(first->value);
-            free(first);
+            q_release_element(first);
+            removed++;
             dup = true;
         } else if (dup) {
             element_t *tmp = list_entry(node, element_t, list);
             list_del(node);
-            free(tmp->value);
-            free(tmp);
+            q_release_element(tmp);
+            removed++;
             dup = false;
         }
     }
+    queue_of(head)->size -= removed;
+    return true;
+}
+
+/* Slot of the Robin Hood hash set used by q_delete_dup_all() */
+typedef struct {
+    element_t *e;  /* First element with its string, NULL if the slot is free */
+    uint32_t hash; /* High half of the string's hash */
+    uint16_t dist; /* Distance from the slot the hash points at */
+    bool dup;      /* Whether e has been moved to the graveyard */
+} dedup_slot_t;
+
+bool q_delete_dup_all(struct list_head *head)
+{
+    queue_to_list(head);
+    if (!head || list_empty(head)) {
+        return false;
+    }
+
+    /* At most half full, which keeps probe sequences short */
+    size_t cap = 2;
+    while (cap < 2 * (size_t) q_size(head)) {
+        cap <<= 1;
+    }
+    dedup_slot_t *slots = calloc(cap, sizeof(dedup_slot_t));
+    if (!slots) {
+        return false;
+    }
+
+    /* Duplicates move here, still readable by later comparisons, and are
+     * only freed once the pass is over
+     */
+    LIST_HEAD(graveyard);
+    struct list_head *node, *safe;
+    int removed = 0;
+
+    list_for_each_safe (node, safe, head) {
+        element_t *e = list_entry(node, element_t, list);
+        uint64_t hash = order->hash(e->value);
+        dedup_slot_t cur = {e, hash >> 32, 0, false};
+
+        for (size_t i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+            dedup_slot_t *slot = &slots[i];
+            if (!slot->e) {
+                *slot = cur;
+                break;
+            }
+            /* Until e has displaced an entry, its string may be present */
+            if (cur.e == e && slot->hash == cur.hash &&
+                !element_cmp(order, slot->e, e)) {
+                if (!slot->dup) {
+                    list_move_tail(&slot->e->list, &graveyard);
+                    slot->dup = true;
+                    removed++;
+                }
+                list_move_tail(node, &graveyard);
+                removed++;
+                break;
+            }
+            /* Robin Hood: take the slot from an entry closer to home */
+            if (slot->dist < cur.dist) {
+                dedup_slot_t tmp = *slot;
+                *slot = cur;
+                cur = tmp;
+            }
+            cur.dist++;
+        }
+    }
+    free(slots);
+
+    list_for_each_safe (node, safe, &graveyard) {
+        q_release_element(list_entry(node, element_t, list));
+    }
+    queue_of(head)->size -= removed;
     return true;
 }
 
@@ -226,9 +1264,19 @@ bool q_delete_dup(struct list_head *head)
 void q_swap(struct list_head *head)
 {
     // https://leetcode.com/problems/swap-nodes-in-pairs/
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
+        return;
+    }
+
+    queue_t *q = ring_of(head);
+    if (q) {
+        for (int i = 0; i + 1 < q->size; i += 2) {
+            ring_exchange(q, i, i + 1);
+        }
+        q->linked = false;
         return;
     }
+    queue_to_list(head);
 
     struct list_head *first, *second;
     list_for_each_safe (first, second, head) {
@@ -251,9 +1299,16 @@ void q_swap(struct list_head *head)
 /* Reverse elements in queue */
 void q_reverse(struct list_head *head)
 {
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
+        return;
+    }
+
+    queue_t *q = ring_of(head);
+    if (q) {
+        ring_reverse(q, 0, q->size);
         return;
     }
+    queue_to_list(head);
     struct list_head *node, *safe;
     list_for_each_safe (node, safe, head) {
         node->next = node->prev;
@@ -268,45 +1323,70 @@ void q_reverse(struct list_head *head)
 void q_reverseK(struct list_head *head, int k)
 {
     // https://leetcode.com/problems/reverse-nodes-in-k-group/
-    if (!head) {
+    if (!head || k <= 1) {
         return;
     }
 
-    int split_time = q_size(head) / k;
-    struct list_head *tail;
-
-    LIST_HEAD(tmp);
-    LIST_HEAD(new_head);
+    /* Only complete groups are reversed; a trailing partial group stays */
+    int groups = q_size(head) / k;
 
-    for (int i = 0; i < split_time; i++) {
-        int j = 0;
-        list_for_each (tail, head) {
-            if (j >= k) {
-                break;
-            }
-            j++;
+    queue_t *q = ring_of(head);
+    if (q) {
+        for (int g = 0; g < groups; g++) {
+            ring_reverse(q, g * k, g * k + k);
+        }
+        return;
+    }
+    queue_to_list(head);
+    struct list_head *before = head;
+
+    for (int g = 0; g < groups; g++) {
+        struct list_head *first = before->next, *node = first;
+
+        /* Swap the links of every node in the group, as q_reverse does */
+        for (int i = 0; i < k; i++) {
+            struct list_head *next = node->next;
+            node->next = node->prev;
+            node->prev = next;
+            node = next;
         }
-        list_cut_position(&tmp, head, tail->prev);
-        q_reverse(&tmp);
-        list_splice_tail_init(&tmp, &new_head);
+
+        /* node is now the first node past the group; fix the boundaries */
+        struct list_head *last = node->prev;
+        before->next = last;
+        last->prev = before;
+        first->next = node;
+        node->prev = first;
+        before = first;
     }
-    list_splice_init(&new_head, head);
 }
 
 /* Start of sort */
-typedef int (*list_cmp_func_t)(const struct list_head *,
+typedef int (*list_cmp_func_t)(void *,
+                               const struct list_head *,
                                const struct list_head *);
 
-static int cmp(const struct list_head *a, const struct list_head *b)
+/* Handed to cmp() as priv, so every algorithm sorts in the requested order
+ * and direction in one pass; ties still compare equal, keeping it stable
+ */
+typedef struct {
+    const queue_order_t *order;
+    bool descend;
+} sort_ctx_t;
+
+static int cmp(void *priv, const struct list_head *a, const struct list_head *b)
 {
+    const sort_ctx_t *ctx = priv;
     const element_t *element_a = list_entry(a, element_t, list);
     const element_t *element_b = list_entry(b, element_t, list);
-    return strcmp(element_a->value, element_b->value);
+    int c = element_cmp(ctx->order, element_a, element_b);
+    return ctx->descend ? -c : c;
 }
 
 typedef int (*compare_func_t)(struct list_head *, struct list_head *);
 
-static struct list_head *merge(list_cmp_func_t cmp,
+static struct list_head *merge(void *priv,
+                               list_cmp_func_t cmp,
                                struct list_head *a,
                                struct list_head *b)
 {
@@ -314,7 +1394,7 @@ static struct list_head *merge(list_cmp_func_t cmp,
 
     for (;;) {
         /* if equal, take 'a' -- important for sort stability */
-        if (cmp(a, b) <= 0) {
+        if (cmp(priv, a, b) <= 0) {
             *tail = a;
             tail = &a->next;
             a = a->next;
@@ -335,7 +1415,8 @@ static struct list_head *merge(list_cmp_func_t cmp,
     return head;
 }
 
-static void merge_final(list_cmp_func_t cmp,
+static void merge_final(void *priv,
+                        list_cmp_func_t cmp,
                         struct list_head *head,
                         struct list_head *a,
                         struct list_head *b)
@@ -345,7 +1426,7 @@ static void merge_final(list_cmp_func_t cmp,
 
     for (;;) {
         /* if equal, take 'a' -- important for sort stability */
-        if (cmp(a, b) <= 0) {
+        if (cmp(priv, a, b) <= 0) {
             tail->next = a;
             a->prev = tail;
             tail = a;
@@ -368,7 +1449,7 @@ static void merge_final(list_cmp_func_t cmp,
     tail->next = b;
     do {
         if (__glibc_unlikely(!++count))
-            cmp(b, b);
+            cmp(priv, b, b);
         b->prev = tail;
         tail = b;
         b = b->next;
@@ -379,7 +1460,7 @@ static void merge_final(list_cmp_func_t cmp,
     head->prev = tail;
 }
 
-void list_sort(struct list_head *head, list_cmp_func_t cmp)
+void list_sort(void *priv, struct list_head *head, list_cmp_func_t cmp)
 {
     struct list_head *list = head->next, *pending = NULL;
     size_t count = 0; /* Count of pending */
@@ -401,7 +1482,7 @@ void list_sort(struct list_head *head, list_cmp_func_t cmp)
         if (__glibc_likely(bits)) {
             struct list_head *a = *tail, *b = a->prev;
 
-            a = merge(cmp, b, a);
+            a = merge(priv, cmp, b, a);
             /* Install the merged result in place of the inputs */
             a->prev = b->prev;
             *tail = a;
@@ -423,19 +1504,671 @@ void list_sort(struct list_head *head, list_cmp_func_t cmp)
 
         if (!next)
             break;
-        list = merge(cmp, pending, list);
+        list = merge(priv, cmp, pending, list);
         pending = next;
     }
     /* The final merge, rebuilding prev links */
-    merge_final(cmp, head, pending, list);
+    merge_final(priv, cmp, head, pending, list);
+}
+
+/* Parallel sort.
+ * The queue is cut into one contiguous run per thread, the runs are sorted
+ * concurrently with list_sort(), and adjacent runs are then merged pairwise,
+ * also concurrently, until two remain for merge_final().  Merging only
+ * neighbours, with ties going to the earlier run, keeps the sort stable.
+ */
+#define MAX_SORT_THREADS 64
+
+/* Below this many elements per thread, threads cost more than they save */
+#define PARALLEL_SORT_MIN 16384
+
+static int sort_threads = 1;
+
+int q_sort_threads(int threads)
+{
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > MAX_SORT_THREADS) {
+        threads = MAX_SORT_THREADS;
+    }
+    sort_threads = threads;
+    return threads;
+}
+
+typedef struct {
+    struct list_head run;
+    sort_ctx_t *ctx;
+} sort_task_t;
+
+typedef struct {
+    struct list_head *a, *b; /* Null-terminated sorted inputs */
+    struct list_head *merged;
+    sort_ctx_t *ctx;
+} merge_task_t;
+
+static void *sort_worker(void *arg)
+{
+    sort_task_t *task = arg;
+    list_sort(task->ctx, &task->run, cmp);
+    return NULL;
+}
+
+static void *merge_worker(void *arg)
+{
+    merge_task_t *task = arg;
+    task->merged = merge(task->ctx, cmp, task->a, task->b);
+    return NULL;
+}
+
+/* Run fn on count tasks of the given size, the first on the calling thread.
+ * A task whose thread cannot be created runs on the calling thread too.
+ */
+static void run_parallel(void *(*fn)(void *),
+                         void *tasks,
+                         size_t size,
+                         int count)
+{
+    pthread_t tids[MAX_SORT_THREADS];
+    bool spawned[MAX_SORT_THREADS] = {false};
+
+    for (int i = 1; i < count; i++) {
+        void *task = (char *) tasks + i * size;
+        spawned[i] = !pthread_create(&tids[i], NULL, fn, task);
+        if (!spawned[i]) {
+            fn(task);
+        }
+    }
+    fn(tasks);
+    for (int i = 1; i < count; i++) {
+        if (spawned[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+}
+
+static void parallel_sort(sort_ctx_t *ctx,
+                          struct list_head *head,
+                          int len,
+                          int threads)
+{
+    sort_task_t runs[MAX_SORT_THREADS];
+    merge_task_t tasks[MAX_SORT_THREADS];
+
+    for (int t = 0; t < threads; t++) {
+        int run_len = len / threads + (t < len % threads);
+        struct list_head *last = head;
+        while (run_len--) {
+            last = last->next;
+        }
+        INIT_LIST_HEAD(&runs[t].run);
+        list_cut_position(&runs[t].run, head, last);
+        runs[t].ctx = ctx;
+    }
+
+    /* The time limit raises SIGALRM, whose handler longjmps out of the
+     * operation.  Hold it off until the workers are joined and the list is
+     * whole again; threads created meanwhile inherit the blocked mask.
+     */
+    sigset_t alarm_set, old_set;
+    sigemptyset(&alarm_set);
+    sigaddset(&alarm_set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm_set, &old_set);
+
+    run_parallel(sort_worker, runs, sizeof(runs[0]), threads);
+
+    /* Convert the sorted runs to null-terminated lists */
+    struct list_head *lists[MAX_SORT_THREADS];
+    for (int t = 0; t < threads; t++) {
+        runs[t].run.prev->next = NULL;
+        lists[t] = runs[t].run.next;
+    }
+
+    int n = threads;
+    while (n > 2) {
+        int pairs = n / 2;
+        for (int i = 0; i < pairs; i++) {
+            tasks[i].a = lists[2 * i];
+            tasks[i].b = lists[2 * i + 1];
+            tasks[i].ctx = ctx;
+        }
+        run_parallel(merge_worker, tasks, sizeof(tasks[0]), pairs);
+        for (int i = 0; i < pairs; i++) {
+            lists[i] = tasks[i].merged;
+        }
+        if (n % 2) {
+            lists[pairs] = lists[n - 1];
+        }
+        n = pairs + n % 2;
+    }
+    merge_final(ctx, cmp, head, lists[0], lists[1]);
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
+
+/* Array-assisted sort.
+ * Each node is snapshotted as its 64-bit order key plus a node pointer into
+ * a contiguous array.  A stable merge sort over the array settles most
+ * comparisons with one integer compare on sequential memory; only pairs
+ * with equal keys chase the string.  The list is relinked
+ * once at the end.  q_sort() may not allocate, so each call keeps its two
+ * scratch arrays on the stack, 128 KiB in all, and longer queues go to the
+ * other algorithms.  Above that length the radix sort is as fast anyway.
+ */
+#define ARRAY_SORT_MIN 64
+#define ARRAY_SORT_MAX 4096
+
+/* Runs this short are insertion sorted before merging */
+#define ARRAY_SORT_RUN 16
+
+typedef struct {
+    uint64_t key;
+    struct list_head *node;
+} sort_entry_t;
+
+typedef struct {
+    sort_entry_t buf[2][ARRAY_SORT_MAX];
+} sort_scratch_t;
+
+static inline int entry_cmp(const sort_entry_t *a,
+                            const sort_entry_t *b,
+                            const sort_ctx_t *ctx)
+{
+    const char *value_a = list_entry(a->node, element_t, list)->value;
+    const char *value_b = list_entry(b->node, element_t, list)->value;
+    int c;
+
+    if (a->key != b->key) {
+        c = a->key < b->key ? -1 : 1;
+    } else if (ctx->order != &q_order_string) {
+        c = ctx->order->cmp(value_a, value_b);
+    } else if (!(a->key & 0xff)) {
+        /* A zero last byte means both strings ended inside the prefix */
+        return 0;
+    } else {
+        /* The key is the prefix itself, so only the rest is left */
+        c = strcmp(value_a + 8, value_b + 8);
+    }
+    return ctx->descend ? -c : c;
+}
+
+/* Sort the len entries of s->buf[0], returning the array that ends up
+ * holding them in order
+ */
+static sort_entry_t *sort_entries(const sort_ctx_t *ctx,
+                                  sort_scratch_t *s,
+                                  int len)
+{
+    sort_entry_t *src = s->buf[0], *dst = s->buf[1];
+
+    /* Insertion sort short runs; entries only move past strictly greater */
+    for (int lo = 0; lo < len; lo += ARRAY_SORT_RUN) {
+        int hi = lo + ARRAY_SORT_RUN < len ? lo + ARRAY_SORT_RUN : len;
+        for (int i = lo + 1; i < hi; i++) {
+            sort_entry_t e = src[i];
+            int j = i;
+            while (j > lo && entry_cmp(&src[j - 1], &e, ctx) > 0) {
+                src[j] = src[j - 1];
+                j--;
+            }
+            src[j] = e;
+        }
+    }
+
+    /* Bottom-up merges, ping-ponging between the two buffers */
+    for (int width = ARRAY_SORT_RUN; width < len; width *= 2) {
+        for (int lo = 0; lo < len; lo += 2 * width) {
+            int mid = lo + width < len ? lo + width : len;
+            int hi = lo + 2 * width < len ? lo + 2 * width : len;
+            int a = lo, b = mid, k = lo;
+            /* if equal, take 'a' -- important for sort stability */
+            while (a < mid && b < hi) {
+                bool take_b = entry_cmp(&src[b], &src[a], ctx) < 0;
+                dst[k++] = take_b ? src[b++] : src[a++];
+            }
+            while (a < mid) {
+                dst[k++] = src[a++];
+            }
+            while (b < hi) {
+                dst[k++] = src[b++];
+            }
+        }
+        sort_entry_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+static void array_sort(const sort_ctx_t *ctx,
+                       sort_scratch_t *s,
+                       struct list_head *head,
+                       int len)
+{
+    sort_entry_t *src = s->buf[0];
+    struct list_head *node;
+    int i = 0;
+
+    list_for_each (node, head) {
+        src[i].key =
+            element_key(ctx->order, list_entry(node, element_t, list));
+        src[i].node = node;
+        i++;
+    }
+
+    src = sort_entries(ctx, s, len);
+    struct list_head *prev = head;
+    for (i = 0; i < len; i++) {
+        prev->next = src[i].node;
+        src[i].node->prev = prev;
+        prev = src[i].node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/* The same over the slots of a ring queue, leaving its list stale */
+static void ring_sort(const sort_ctx_t *ctx, sort_scratch_t *s, queue_t *q)
+{
+    sort_entry_t *src = s->buf[0];
+
+    for (int i = 0; i < q->size; i++) {
+        element_t *e = *ring_slot(q, i);
+        src[i].key = element_key(ctx->order, e);
+        src[i].node = &e->list;
+    }
+
+    src = sort_entries(ctx, s, q->size);
+    for (int i = 0; i < q->size; i++) {
+        *ring_slot(q, i) = list_entry(src[i].node, element_t, list);
+    }
+    q->linked = false;
+}
+
+/* MSD radix sort.
+ * Nodes are distributed by the byte at the current depth into 256 bucket
+ * lists, straight on the linked list, and each bucket is sorted on the next
+ * byte.  Bucket 0 collects strings that ended, which are all equal.  Nodes
+ * are appended to buckets in order, so the sort is stable, and nothing is
+ * allocated.  Small buckets, and prefixes so long that the bucket heads
+ * would use too much stack, are handed to list_sort().  A descending sort
+ * collects the buckets in reverse, with bucket 0 last.  Bytes only give the
+ * string order; q_sort() uses list_sort() instead for the others.
+ */
+#define RADIX_SORT_CUTOFF 32
+#define RADIX_SORT_MAX_DEPTH 16
+
+/* Sort len nodes of head, whose strings all share their first depth bytes */
+static void radix_sort(sort_ctx_t *ctx,
+                       struct list_head *head,
+                       int len,
+                       int depth)
+{
+    if (len < RADIX_SORT_CUTOFF || depth >= RADIX_SORT_MAX_DEPTH) {
+        list_sort(ctx, head, cmp);
+        return;
+    }
+
+    struct list_head buckets[256];
+    int counts[256] = {0};
+    for (int c = 0; c < 256; c++) {
+        INIT_LIST_HEAD(&buckets[c]);
+    }
+
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, head) {
+        const element_t *e = list_entry(node, element_t, list);
+#if ELEMENT_KEY_CACHE
+        unsigned char c = depth < 8 ? e->prefix >> (56 - 8 * depth) & 0xff
+                                    : e->value[depth];
+#else
+        unsigned char c = e->value[depth];
+#endif
+        list_move_tail(node, &buckets[c]);
+        counts[c]++;
+    }
+
+    if (!ctx->descend) {
+        list_splice_tail(&buckets[0], head);
+    }
+    for (int i = 1; i < 256; i++) {
+        int c = ctx->descend ? 256 - i : i;
+        if (!counts[c]) {
+            continue;
+        }
+        radix_sort(ctx, &buckets[c], counts[c], depth + 1);
+        list_splice_tail(&buckets[c], head);
+    }
+    if (ctx->descend) {
+        list_splice_tail(&buckets[0], head);
+    }
+}
+
+/* Adaptive natural merge sort, after TimSort.
+ * The queue is cut into runs that are already in order: non-decreasing
+ * runs are taken as they are, strictly descending ones are reversed in
+ * place, which cannot reorder equal elements.  Runs shorter than min_run,
+ * at most ADAPTIVE_MIN_RUN, are extended by insertion, which on a list
+ * costs more comparisons than merging, so min_run stays small.  Runs are
+ * kept on a stack whose lengths satisfy the TimSort invariants, so merges
+ * stay balanced, and only neighbouring runs are merged, earlier run first,
+ * for stability.
+ * A merge that keeps taking from one side switches to galloping: it probes
+ * that run at exponentially growing strides and splices the whole block at
+ * once.  Sorted and reverse-sorted queues cost n - 1 comparisons.
+ */
+#define ADAPTIVE_MIN_RUN 8
+#define ADAPTIVE_MIN_GALLOP 7
+
+/* Run lengths grow at least like Fibonacci numbers, so 64 runs is plenty */
+#define ADAPTIVE_MAX_RUNS 64
+
+typedef struct {
+    struct list_head *list; /* Null-terminated by ->next */
+    int len;
+} sort_run_t;
+
+/* Starting at first, which is known to pass, find the last node of the
+ * null-terminated list with cmp(node, key) < limit.  Stores the number of
+ * nodes up to and including it in count.
+ */
+static struct list_head *gallop(void *priv,
+                                list_cmp_func_t cmp,
+                                struct list_head *first,
+                                const struct list_head *key,
+                                int limit,
+                                int *count)
+{
+    struct list_head *last = first;
+    int taken = 1;
+
+    for (int step = 1;; step *= 2) {
+        struct list_head *probe = last;
+        int i;
+        for (i = 0; i < step && probe->next; i++) {
+            probe = probe->next;
+        }
+        if (!i) {
+            break;
+        }
+        if (cmp(priv, probe, key) < limit) {
+            last = probe;
+            taken += i;
+            continue;
+        }
+
+        /* The boundary is among the i - 1 nodes between last and probe */
+        for (int n = i - 1; n > 0;) {
+            int half = (n + 1) / 2;
+            struct list_head *mid = last;
+            for (int j = 0; j < half; j++) {
+                mid = mid->next;
+            }
+            if (cmp(priv, mid, key) < limit) {
+                last = mid;
+                taken += half;
+                n -= half;
+            } else {
+                n = half - 1;
+            }
+        }
+        break;
+    }
+    *count = taken;
+    return last;
+}
+
+static struct list_head *merge_gallop(void *priv,
+                                      list_cmp_func_t cmp,
+                                      struct list_head *a,
+                                      struct list_head *b,
+                                      int *min_gallop)
+{
+    struct list_head *head = NULL, **tail = &head;
+    int a_wins = 0, b_wins = 0;
+
+    while (a && b) {
+        struct list_head *last;
+        int n;
+
+        /* if equal, take 'a' -- important for sort stability */
+        if (cmp(priv, a, b) <= 0) {
+            b_wins = 0;
+            if (++a_wins < *min_gallop) {
+                *tail = a;
+                tail = &a->next;
+                a = a->next;
+                continue;
+            }
+            last = gallop(priv, cmp, a, b, 1, &n);
+            *tail = a;
+            tail = &last->next;
+            a = last->next;
+            a_wins = 0;
+        } else {
+            a_wins = 0;
+            if (++b_wins < *min_gallop) {
+                *tail = b;
+                tail = &b->next;
+                b = b->next;
+                continue;
+            }
+            last = gallop(priv, cmp, b, a, 0, &n);
+            *tail = b;
+            tail = &last->next;
+            b = last->next;
+            b_wins = 0;
+        }
+
+        /* Gallop sooner on data where it pays off, later where it does not */
+        if (n >= ADAPTIVE_MIN_GALLOP) {
+            *min_gallop -= *min_gallop > 1;
+        } else {
+            (*min_gallop)++;
+        }
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/* Take the next run off the null-terminated list and return it in order */
+static struct list_head *next_run(void *priv,
+                                  list_cmp_func_t cmp,
+                                  struct list_head **list,
+                                  int *len,
+                                  int min_run)
+{
+    struct list_head *run = *list, *tail = run, *next = run->next;
+    int n = 1;
+
+    if (next && cmp(priv, run, next) > 0) {
+        /* Strictly descending, so reversing keeps equal elements apart */
+        run->next = NULL;
+        do {
+            struct list_head *after = next->next;
+            next->next = run;
+            run = next;
+            next = after;
+            n++;
+        } while (next && cmp(priv, run, next) > 0);
+    } else if (next) {
+        do {
+            tail = next;
+            next = next->next;
+            n++;
+        } while (next && cmp(priv, tail, next) <= 0);
+        tail->next = NULL;
+    }
+
+    /* Extend short runs; a node goes after every element equal to it */
+    while (n < min_run && next) {
+        struct list_head *node = next, **pos = &run;
+        next = next->next;
+        while (*pos && cmp(priv, *pos, node) <= 0) {
+            pos = &(*pos)->next;
+        }
+        node->next = *pos;
+        *pos = node;
+        n++;
+    }
+
+    *list = next;
+    *len = n;
+    return run;
+}
+
+static void merge_runs(void *priv,
+                       list_cmp_func_t cmp,
+                       sort_run_t *runs,
+                       int *top,
+                       int at,
+                       int *min_gallop)
+{
+    runs[at].list = merge_gallop(priv, cmp, runs[at].list, runs[at + 1].list,
+                                 min_gallop);
+    runs[at].len += runs[at + 1].len;
+    for (int i = at + 1; i < *top - 1; i++) {
+        runs[i] = runs[i + 1];
+    }
+    (*top)--;
+}
+
+static void adaptive_sort(void *priv,
+                          struct list_head *head,
+                          int len,
+                          list_cmp_func_t cmp)
+{
+    if (list_empty(head) || list_is_singular(head)) {
+        return;
+    }
+
+    sort_run_t runs[ADAPTIVE_MAX_RUNS];
+    struct list_head *list = head->next;
+    int top = 0, min_gallop = ADAPTIVE_MIN_GALLOP;
+
+    /* Pick min_run so the number of runs in random input is a power of two,
+     * or just below one, which keeps the final merges balanced
+     */
+    int min_run = 0;
+    while (len >= ADAPTIVE_MIN_RUN) {
+        min_run |= len & 1;
+        len >>= 1;
+    }
+    min_run += len;
+
+    head->prev->next = NULL;
+    while (list) {
+        runs[top].list =
+            next_run(priv, cmp, &list, &runs[top].len, min_run);
+        top++;
+
+        /* Restore the invariants on the topmost runs X, Y and Z:
+         * len(Z) > len(Y) + len(X) and len(Y) > len(X)
+         */
+        while (top > 1) {
+            int n = top - 2;
+            if ((n > 0 && runs[n - 1].len <= runs[n].len + runs[n + 1].len) ||
+                (n > 1 && runs[n - 2].len <= runs[n - 1].len + runs[n].len)) {
+                if (runs[n - 1].len < runs[n + 1].len) {
+                    n--;
+                }
+            } else if (runs[n].len > runs[n + 1].len) {
+                break;
+            }
+            merge_runs(priv, cmp, runs, &top, n, &min_gallop);
+        }
+    }
+
+    while (top > 1) {
+        int n = top - 2;
+        if (n > 0 && runs[n - 1].len < runs[n + 1].len) {
+            n--;
+        }
+        merge_runs(priv, cmp, runs, &top, n, &min_gallop);
+    }
+
+    /* Rebuild the prev links */
+    struct list_head *prev = head, *node;
+    head->next = runs[0].list;
+    for (node = runs[0].list; node; node = node->next) {
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/* Whether the queue opens with an ordered run of at least len / 8 nodes, a
+ * sign that it is presorted and adaptive_sort() beats the others.  Random
+ * input is rejected within a few comparisons.
+ */
+static bool presorted(sort_ctx_t *ctx, struct list_head *head, int len)
+{
+    struct list_head *node = head->next;
+
+    if (len < ARRAY_SORT_MIN) {
+        return false;
+    }
+    bool descending = cmp(ctx, node, node->next) > 0;
+    for (int i = 0; i < len / 8; i++, node = node->next) {
+        int c = cmp(ctx, node, node->next);
+        if (descending ? c <= 0 : c > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int sort_mode = SORT_AUTO;
+
+void q_sort_mode(int mode)
+{
+    sort_mode = mode;
 }
 
 void q_sort(struct list_head *head, bool descend)
 {
-    list_sort(head, cmp);
+    if (!head) {
+        return;
+    }
 
-    if (descend) {
-        q_reverse(head);
+    sort_ctx_t ctx = {.order = order, .descend = descend};
+    sort_scratch_t scratch;
+
+    int len = q_size(head);
+    int threads = sort_threads;
+    if (threads > len / PARALLEL_SORT_MIN) {
+        threads = len / PARALLEL_SORT_MIN;
+    }
+
+    bool fits_array = len >= 2 && len <= ARRAY_SORT_MAX;
+
+    /* A ring queue already is an array; anything else sorts its list */
+    queue_t *q = ring_of(head);
+    if (q && fits_array &&
+        (sort_mode == SORT_AUTO || sort_mode == SORT_ARRAY)) {
+        ring_sort(&ctx, &scratch, q);
+        return;
+    }
+    queue_to_list(head);
+
+    if (sort_mode == SORT_AUTO) {
+        fits_array = fits_array && len >= ARRAY_SORT_MIN;
+    }
+
+    if (sort_mode == SORT_AUTO && threads > 1) {
+        parallel_sort(&ctx, head, len, threads);
+    } else if (sort_mode == SORT_ADAPTIVE ||
+               (sort_mode == SORT_AUTO && presorted(&ctx, head, len))) {
+        adaptive_sort(&ctx, head, len, cmp);
+    } else if ((sort_mode == SORT_AUTO || sort_mode == SORT_ARRAY) &&
+               fits_array) {
+        array_sort(&ctx, &scratch, head, len);
+    } else if (order == &q_order_string &&
+               (sort_mode == SORT_RADIX ||
+                (sort_mode == SORT_AUTO && len > ARRAY_SORT_MAX))) {
+        radix_sort(&ctx, head, len, 0);
+    } else {
+        list_sort(&ctx, head, cmp);
     }
 }
 
@@ -447,22 +2180,29 @@ void q_sort(struct list_head *head, bool descend)
 int q_ascend(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
         return 0;
     }
 
-    const char *min = list_entry(head->prev, element_t, list)->value;
+    queue_t *q = chunks_of(head);
+    if (q) {
+        return chunks_filter(q, 1);
+    }
+    queue_to_list(head);
+
+    const element_t *min = list_entry(head->prev, element_t, list);
 
     struct list_head *current, *safe;
     for (current = (head)->prev, safe = current->prev; current != head;
          current = safe, safe = current->prev) {
         element_t *current_entry = list_entry(current, element_t, list);
-        if (strcmp(current_entry->value, min) > 0) {
+        int c = element_cmp(order, current_entry, min);
+        if (c > 0) {
             list_del(current);
-            free(current_entry->value);
-            free(current_entry);
-        } else if (strcmp(current_entry->value, min) < 0) {
-            min = current_entry->value;
+            q_release_element(current_entry);
+            queue_of(head)->size--;
+        } else if (c < 0) {
+            min = current_entry;
         }
     }
 
@@ -474,22 +2214,29 @@ int q_ascend(struct list_head *head)
 int q_descend(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
         return 0;
     }
 
-    const char *max = list_entry(head->prev, element_t, list)->value;
+    queue_t *q = chunks_of(head);
+    if (q) {
+        return chunks_filter(q, -1);
+    }
+    queue_to_list(head);
+
+    const element_t *max = list_entry(head->prev, element_t, list);
 
     struct list_head *current, *safe;
     for (current = (head)->prev, safe = current->prev; current != head;
          current = safe, safe = current->prev) {
         element_t *current_entry = list_entry(current, element_t, list);
-        if (strcmp(current_entry->value, max) < 0) {
+        int c = element_cmp(order, current_entry, max);
+        if (c < 0) {
             list_del(current);
-            free(current_entry->value);
-            free(current_entry);
-        } else if (strcmp(current_entry->value, max) > 0) {
-            max = current_entry->value;
+            q_release_element(current_entry);
+            queue_of(head)->size--;
+        } else if (c > 0) {
+            max = current_entry;
         }
     }
 
@@ -499,25 +2246,70 @@ int q_descend(struct list_head *head)
 /* Merge all the queues into one sorted queue, which is in
  * ascending/descending order */
 
-int merge_queue(struct list_head *first, struct list_head *second)
+/* One input of the k-way merge, keyed by the first element of its queue */
+typedef struct {
+    struct list_head *q;
+    int order; /* Position among the inputs; earlier wins ties for stability */
+} merge_way_t;
+
+/* Inputs merged at once; a longer chain is folded in batches */
+#define MERGE_MAX_WAYS 256
+
+static inline bool way_before(const merge_way_t *a,
+                              const merge_way_t *b,
+                              bool descend)
 {
-    if (!first || !second) {
-        return 0;
+    int c = element_cmp(order, list_first_entry(a->q, element_t, list),
+                        list_first_entry(b->q, element_t, list));
+    if (descend) {
+        c = -c;
+    }
+    return c < 0 || (c == 0 && a->order < b->order);
+}
+
+static void heap_sift_down(merge_way_t *heap, int n, int i, bool descend)
+{
+    merge_way_t top = heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            way_before(&heap[child + 1], &heap[child], descend)) {
+            child++;
+        }
+        if (!way_before(&heap[child], &top, descend)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = top;
+}
+
+/* Merge the non-empty sorted queues in heap[0..n) onto the tail of out */
+static void merge_ways(merge_way_t *heap, int n, struct list_head *out,
+                       bool descend)
+{
+    for (int i = n / 2 - 1; i >= 0; i--) {
+        heap_sift_down(heap, n, i, descend);
+    }
+
+    while (n > 1) {
+        struct list_head *q = heap[0].q;
+        list_move_tail(q->next, out);
+        if (list_empty(q)) {
+            heap[0] = heap[--n];
+        }
+        heap_sift_down(heap, n, 0, descend);
     }
 
-    LIST_HEAD(tmp);
-    while (!list_empty(first) && !list_empty(second)) {
-        element_t *element_1 = list_first_entry(first, element_t, list);
-        element_t *element_2 = list_first_entry(second, element_t, list);
-        element_t *element_min = strcmp(element_1->value, element_2->value) < 0
-                                     ? element_1
-                                     : element_2;
-        list_move_tail(&element_min->list, &tmp);
+    /* The last input left is already in order */
+    if (n == 1) {
+        list_splice_tail_init(heap[0].q, out);
     }
-    list_splice_tail_init(first, &tmp);
-    list_splice_tail_init(second, &tmp);
-    list_splice(&tmp, first);
-    return q_size(first);
 }
 
 int q_merge(struct list_head *head, bool descend)
@@ -525,28 +2317,40 @@ int q_merge(struct list_head *head, bool descend)
     // https://leetcode.com/problems/merge-k-sorted-lists/
     if (!head || list_empty(head)) {
         return 0;
-    } else if (list_is_singular(head)) {
-        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
     }
 
-    int size = q_size(head);
-    int count = (size % 2) ? size / 2 + 1 : size / 2;
-    int queue_size = 0;
-
-    for (int i = 0; i < count; i++) {
-        queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
-        queue_contex_t *second =
-            list_entry(first->chain.next, queue_contex_t, chain);
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    if (list_is_singular(head)) {
+        return q_size(first->q);
+    }
 
-        while (!list_empty(first->q) && !list_empty(second->q)) {
-            queue_size = merge_queue(first->q, second->q);
-            list_move_tail(&second->chain, head);
-            first = list_entry(first->chain.next, queue_contex_t, chain);
-            second = list_entry(first->chain.next, queue_contex_t, chain);
+    merge_way_t heap[MERGE_MAX_WAYS];
+    int n = 0, total = 0;
+    LIST_HEAD(out);
+    queue_contex_t *ctx;
+
+    list_for_each_entry (ctx, head, chain) {
+        queue_to_list(ctx->q);
+        total += q_size(ctx->q);
+        queue_of(ctx->q)->size = 0;
+        if (list_empty(ctx->q)) {
+            continue;
         }
+        if (n == MERGE_MAX_WAYS) {
+            /* Fold the batch into the first queue, which stays an input */
+            merge_ways(heap, n, &out, descend);
+            list_splice_init(&out, first->q);
+            heap[0].q = first->q;
+            heap[0].order = 0;
+            n = 1;
+        }
+        heap[n].q = ctx->q;
+        heap[n].order = n;
+        n++;
     }
-    if (descend) {
-        q_reverse(head);
-    }
-    return queue_size;
+
+    merge_ways(heap, n, &out, descend);
+    list_splice(&out, first->q);
+    queue_of(first->q)->size = total;
+    return total;
 }
@@ -9,22 +9,92 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Define ELEMENT_KEY_CACHE as 1 to also keep the first 8 bytes of each string,
+ * as a big-endian integer, and its length in the element, filled in on
+ * insert.  Comparisons then mostly settle on the cached key, in the node's
+ * own cache line, without chasing the string.  Build with 'make KEY_CACHE=1'.
+ */
+#ifndef ELEMENT_KEY_CACHE
+#define ELEMENT_KEY_CACHE 0
+#endif
+
+/* Strings of at most ELEMENT_INLINE_LEN characters are stored inside the
+ * element itself, so that the node and its string share one allocation.  The
+ * default keeps such an element within a 64-byte cache line.  Longer strings
+ * spill into a separate allocation.  Define it as 0 to always spill.
+ */
+#ifndef ELEMENT_INLINE_LEN
+#if ELEMENT_KEY_CACHE
+#define ELEMENT_INLINE_LEN 23
+#else
+#define ELEMENT_INLINE_LEN 39
+#endif
+#endif
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @prefix: first 8 bytes of @value, big-endian, zero padded past its end
+ * @len: length of @value, saturated at UINT32_MAX
+ * @inline_value: storage for short strings, see ELEMENT_INLINE_LEN
  *
- * @value needs to be explicitly allocated and freed
+ * @value either points to @inline_value, or to a separately allocated string
+ * which needs to be explicitly freed.  @prefix and @len only exist with
+ * ELEMENT_KEY_CACHE, and must be kept in step with @value.
  */
 typedef struct {
     char *value;
     struct list_head list;
+#if ELEMENT_KEY_CACHE
+    uint64_t prefix;
+    uint32_t len;
+#endif
+    char inline_value[];
 } element_t;
 
+/**
+ * queue_t - Header of a queue
+ * @head: head of the circular list of elements
+ * @size: number of elements in the queue
+ * @ring: slots of a ring queue, NULL for a list queue
+ * @ring_mask: number of slots in @ring minus one, the count being a power of 2
+ * @ring_first: slot of the first element
+ * @chunks: chunks of an unrolled queue
+ * @spare: empty chunks kept for reuse by an unrolled queue
+ * @unrolled: whether this is an unrolled queue
+ * @linked: whether the list through @head mirrors @ring or @chunks
+ * @listed: whether the list through @head holds the elements, always true
+ *          for a list queue
+ *
+ * Queue operations take a pointer to @head; @size is kept exact by every
+ * operation that adds or removes elements, so that q_size() is O(1).
+ *
+ * A ring queue, made by q_new_ring(), keeps its elements as a circular deque
+ * of pointers in @ring.  Operations at the ends and reordering operations
+ * work on the array; the others go through the list, which is threaded on
+ * demand and then holds the elements (@listed) until the next operation that
+ * can reload the array.  An unrolled queue, made by q_new_unrolled(), works
+ * the same way with a list of chunks, each holding a run of pointers.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    element_t **ring;
+    unsigned ring_mask;
+    unsigned ring_first;
+    struct list_head chunks;
+    struct list_head spare;
+    bool unrolled;
+    bool linked;
+    bool listed;
+} queue_t;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -48,6 +118,50 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/**
+ * q_new_ring() - Create an empty queue kept in a growable ring of pointers
+ *
+ * The queue supports every operation of a queue made by q_new().  Insertion
+ * and removal at either end are O(1) amortized and touch no neighbouring
+ * element, and q_reverse(), q_swap(), q_reverseK(), q_shuffle() and q_sort()
+ * move pointers in a contiguous array.  Walking the list view of the queue
+ * requires q_link() first.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_ring();
+
+/**
+ * q_new_unrolled() - Create an empty queue kept in a list of pointer chunks
+ *
+ * The queue supports every operation of a queue made by q_new().  Elements
+ * are referenced from fixed-size chunks, each a cache-line pair holding a run
+ * of pointers, so insertion and removal at either end are O(1) without ever
+ * moving more than one pointer, and q_ascend() and q_descend() scan and
+ * compact the pointers in place.  Walking the list view of the queue
+ * requires q_link() first.
+ *
+ * Every element still carries its list node, and once the list view is
+ * threaded, insertions keep it threaded, writing the node as well as the
+ * chunk slot.  The queue thus takes a pointer per element more than a list
+ * queue.  Apart from q_shuffle(), the operations not named above go through
+ * the list.
+ *
+ * Return: NULL for allocation failed
+ */
+struct list_head *q_new_unrolled();
+
+/**
+ * q_link() - Make the list through the header reflect the queue
+ * @head: header of queue
+ *
+ * Threads the list of a ring queue through its elements, in queue order, if
+ * an operation on the ring left it stale.  Elements inserted or removed one
+ * at a time keep the list in step, so calling this after each of them is
+ * O(1).  No effect on a list queue or if header is NULL.
+ */
+void q_link(struct list_head *head);
+
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
@@ -78,6 +192,47 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_move() - Insert an element at the head, taking over a string
+ * @head: header of queue
+ * @s: string to be stored, allocated with malloc()
+ *
+ * Unlike q_insert_head(), @s is not copied: on success the element owns it,
+ * and q_release_element() frees it with the element.  On failure @s still
+ * belongs to the caller.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_move(struct list_head *head, char *s);
+
+/**
+ * q_insert_tail_move() - Insert an element at the tail, taking over a string
+ * @head: header of queue
+ * @s: string to be stored, allocated with malloc()
+ *
+ * See q_insert_head_move().
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_move(struct list_head *head, char *s);
+
+/**
+ * q_insert_bulk() - Insert a batch of elements at the head or the tail
+ * @head: header of queue
+ * @strings: the n strings to be stored, copied as by q_insert_head()
+ * @n: number of strings
+ * @tail: whether to insert at the tail rather than the head
+ *
+ * The batch is built aside and spliced in at once, keeping the order of
+ * @strings: strings[0] ends up first at the head, or right after the old last
+ * element at the tail.  Either all elements are inserted or none is.
+ *
+ * Return: true for success, false for allocation failed, negative @n or
+ * queue is NULL
+ */
+bool q_insert_bulk(struct list_head *head, char *const strings[], int n,
+                   bool tail);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,15 +263,41 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_bulk() - Remove up to n elements from the head or the tail
+ * @head: header of queue
+ * @out: list the removed elements are appended to, in queue order
+ * @n: number of elements to remove
+ * @tail: whether to remove from the tail rather than the head
+ * @sp: optional output buffer where the removed strings are packed
+ * @bufsize: size of @sp
+ *
+ * The elements are cut off as one segment: the walk to its boundary starts
+ * from whichever end of the queue is nearer, and the relink is O(1).  If @sp
+ * is non-NULL, the removed strings are copied into it back to back, in queue
+ * order, each with its null terminator.  Copying stops when @sp is full; the
+ * last string copied is then truncated, but still terminated.
+ *
+ * As with q_remove_head(), the elements are unlinked, not freed.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_bulk(struct list_head *head, struct list_head *out, int n,
+                  bool tail, char *sp, size_t bufsize);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
+ * A string not stored inline is freed along with the element, whether it was
+ * copied on insertion or handed over to q_insert_head_move().
+ *
  * This function is intended for internal use only.
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
+    if (e->value != e->inline_value)
+        test_free(e->value);
     test_free(e);
 }
 
@@ -124,10 +305,27 @@ static inline void q_release_element(element_t *e)
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * Runs in constant time, using the length kept in queue_t.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
 
+/**
+ * q_shuffle() - Rearrange the elements in a uniformly random order
+ * @head: header of queue
+ *
+ * Performs a Fisher-Yates shuffle driven by a splitmix generator, in O(n)
+ * time.  A ring queue is shuffled in place; an unrolled queue is shuffled in
+ * its chunks, through a table of one pointer per chunk, and any other queue
+ * through a scratch array of node pointers.  The queue is left unchanged if
+ * the table or the array cannot be allocated.
+ * No effect if queue has fewer than two elements.
+ *
+ * Return: false if queue is NULL or the scratch space cannot be allocated
+ */
+bool q_shuffle(struct list_head *head);
+
 /**
  * q_delete_mid() - Delete the middle node in queue
  * @head: header of queue
@@ -155,6 +353,20 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_all() - Delete all nodes whose string occurs more than once
+ * anywhere in the queue, leaving the distinct strings in their original order.
+ * @head: header of queue
+ *
+ * Unlike q_delete_dup(), the queue need not be sorted.  Strings are counted in
+ * one pass with a hash set, which is allocated; on allocation failure the
+ * queue is left untouched.
+ *
+ * Return: true for success, false if list is NULL or empty, or allocation
+ * failed.
+ */
+bool q_delete_dup_all(struct list_head *head);
+
 /**
  * q_swap() - Swap every two adjacent nodes
  * @head: header of queue
@@ -200,6 +412,37 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/* Algorithms q_sort() can be told to use */
+enum {
+    SORT_AUTO,     /* Choose by queue length and thread count */
+    SORT_LIST,     /* Bottom-up merge sort on the list, list_sort() */
+    SORT_ARRAY,    /* Merge sort of (key prefix, node) pairs in an array */
+    SORT_RADIX,    /* MSD radix sort on the bytes of the strings */
+    SORT_ADAPTIVE, /* Natural merge sort with galloping, after TimSort */
+};
+
+/**
+ * q_sort_mode() - Select the algorithm used by q_sort()
+ * @mode: one of SORT_AUTO, SORT_LIST, SORT_ARRAY, SORT_RADIX or SORT_ADAPTIVE
+ *
+ * SORT_ARRAY falls back to SORT_LIST for queues too long for its scratch
+ * arrays on the stack.  SORT_AUTO uses threads when enabled, SORT_ADAPTIVE
+ * for queues that open with a long ordered run, SORT_ARRAY for queues that
+ * fit its arrays and SORT_RADIX beyond that.  Every algorithm is stable.
+ */
+void q_sort_mode(int mode);
+
+/**
+ * q_sort_threads() - Set how many threads q_sort() may use
+ * @threads: number of threads, clamped to [1, 64]
+ *
+ * Large queues are cut into one run per thread; the runs are sorted and
+ * merged concurrently.  The result is stable, as with a single thread.
+ *
+ * Return: the number of threads q_sort() will use, after clamping
+ */
+int q_sort_threads(int threads);
+
 /**
  * q_ascend() - Delete every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -250,4 +493,55 @@ int q_descend(struct list_head *head);
  */
 int q_merge(struct list_head *head, bool descend);
 
+/**
+ * queue_order_t - An order on element strings shared by queue operations
+ * @name: short name of the order
+ * @cmp: three-way comparison of two strings, like strcmp()
+ * @key: order-preserving 64-bit key of string @s, given its first 8 bytes as
+ *       a big-endian integer zero padded past its end, and its length.  A
+ *       smaller key means a smaller string; equal keys leave it to @cmp.
+ * @key_needs_string: @key reads @s, rather than only the prefix and length,
+ *       so keys cached by ELEMENT_KEY_CACHE do not make it cheap.
+ * @hash: hash of a string; strings that @cmp calls equal hash alike.
+ *
+ * q_sort(), q_delete_dup(), q_delete_dup_all(), q_ascend(), q_descend() and
+ * q_merge() all compare through the current order.  Sorts compare keys
+ * first, which settles most comparisons with one integer compare instead of
+ * chasing two strings.
+ */
+typedef struct {
+    const char *name;
+    int (*cmp)(const char *a, const char *b);
+    uint64_t (*key)(uint64_t prefix, size_t len, const char *s);
+    bool key_needs_string;
+    uint64_t (*hash)(const char *s);
+} queue_order_t;
+
+/* Byte order, as strcmp(); the default */
+extern const queue_order_t q_order_string;
+
+/* Value as parsed by strtoll(), ties broken by byte order */
+extern const queue_order_t q_order_numeric;
+
+/* Byte order with ASCII letters folded to lower case, as strcasecmp() */
+extern const queue_order_t q_order_nocase;
+
+/* Shorter strings first, equal lengths in byte order */
+extern const queue_order_t q_order_length;
+
+/**
+ * q_set_order() - Select the order used by queue operations
+ * @order: the order, or NULL for q_order_string
+ */
+void q_set_order(const queue_order_t *order);
+
+/**
+ * q_compare() - Compare two strings in the current order
+ * @a: first string
+ * @b: second string
+ *
+ * Return: negative, zero or positive as @a sorts before, with or after @b
+ */
+int q_compare(const char *a, const char *b);
+
 #endif /* LAB0_QUEUE_H */
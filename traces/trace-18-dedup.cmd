@@ -0,0 +1,40 @@
+# Test of 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', and 'q_delete_dup' on unsorted queues
+option fail 0
+option malloc 0
+new
+it b
+it a
+it c
+it b
+it d
+it a
+it b
+dedup all
+rh c
+rh d
+free
+new ring
+ih e
+ih f
+ih e
+ih g
+ih e
+dedup all
+rh g
+rt f
+free
+new unrolled
+it x 20
+it y
+it z 15
+it w
+dedup all
+rh y
+rh w
+free
+new
+it gerbil
+it gerbil
+dedup all
+free
+quit
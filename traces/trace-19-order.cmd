@@ -0,0 +1,49 @@
+# Test of element orders: 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_sort', and 'q_descend'
+option fail 0
+option malloc 0
+option order 1
+new
+it 10
+it 9
+it 100
+it -3
+sort
+rh -3
+rh 9
+rh 10
+rh 100
+free
+new ring
+ih 7
+ih 20
+ih 3
+ih 11
+descend
+rh 20
+rh 7
+free
+option order 2
+new
+it b
+it A
+it c
+it B
+sort
+rh A
+rh b
+rh B
+rh c
+free
+option order 3
+new unrolled
+it ccc
+it a
+it bb
+it dd
+sort
+rh a
+rh bb
+rh dd
+rh ccc
+free
+quit
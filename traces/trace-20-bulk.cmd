@@ -0,0 +1,42 @@
+# Test of 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_insert_bulk', 'q_remove_head', and 'q_remove_tail'
+option fail 0
+option malloc 0
+new
+itb b 3
+ihb a 2
+itb c
+ih z
+it y
+rh z
+rh a
+rh a
+rh b
+rh b
+rh b
+rh c
+rh y
+itb j 5000
+ihb k 5000
+rh k
+rt j
+free
+new ring
+ihb d 40
+itb e 2
+ihb RAND 5
+rt e
+rt e
+rt d
+free
+new unrolled
+itb f 30
+ihb g 15
+it h
+rh g
+rt h
+rt f
+ihb RAND 100
+itb i
+rt i
+free
+quit
@@ -0,0 +1,39 @@
+# Test of 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', and 'q_remove_bulk'
+option fail 0
+option malloc 0
+new
+it a
+it b
+it c
+it d
+it e
+it f
+rhb 2
+rh c
+rtb 2
+rt d
+rhb 5
+free
+new ring
+ih gerbil 10
+it lion 10
+ih zebra
+rhb 3
+rh gerbil
+rtb 9
+rt lion
+rh gerbil
+free
+new unrolled
+it meerkat 30
+it panda
+option length 20
+rhb 12
+rh meerkat
+option length 5
+rtb 4
+rt meerk
+option length 1024
+rh meerkat
+free
+quit
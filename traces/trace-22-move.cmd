@@ -0,0 +1,31 @@
+# Test of 'q_new', 'q_free', 'q_insert_head_move', 'q_insert_tail_move', 'q_remove_head', 'q_remove_tail', and 'q_reverse'
+option fail 0
+option malloc 0
+option move 1
+new
+ih b
+ih a
+it c
+it d 3
+ih RAND 4
+rt d
+reverse
+rh d
+rh d
+rh c
+rh b
+rh a
+free
+new ring
+it gerbil 5
+ih lion
+rh lion
+rt gerbil
+free
+new unrolled
+it zebra 20
+ih panda
+rt zebra
+rh panda
+free
+quit
@@ -0,0 +1,41 @@
+# Test of 'q_new', 'q_free', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_shuffle', and 'q_sort'
+option fail 0
+option malloc 0
+new
+shuffle
+it a
+shuffle
+it b
+it c
+it d
+it e
+shuffle 3
+sort
+rh a
+rh b
+rh c
+rh d
+rh e
+free
+new ring
+it gerbil 10
+ih dolphin 10
+it lion
+shuffle 5
+sort
+rh dolphin
+rt lion
+rt gerbil
+free
+new unrolled
+it meerkat 30
+ih bear
+it panda
+rh bear
+shuffle 4
+sort
+rt panda
+rh meerkat
+rt meerkat
+free
+quit
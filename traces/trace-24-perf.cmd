@@ -0,0 +1,37 @@
+# Test performance of 'q_reverseK' with K at and beyond the queue size: 'q_new', 'q_insert_head', 'q_insert_tail', 'q_remove_head', 'q_remove_tail', 'q_size', and 'q_reverseK'
+option fail 0
+option malloc 0
+new
+it a
+it b
+it c
+it gerbil 999997
+it y
+it z
+size
+reverseK 1000003
+rh a
+ih a
+rt z
+it z
+reverseK 2147483647
+rh a
+ih a
+rt z
+it z
+reverseK 1000002
+rh z
+ih z
+rt a
+it a
+reverseK 1000002
+reverseK 4
+rh gerbil
+rh c
+rh b
+rh a
+rt z
+rt y
+reverseK 3
+size
+free
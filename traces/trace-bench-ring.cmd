@@ -0,0 +1,25 @@
+# Benchmark of a ring queue against a list queue
+# Compare the 'Delta time' reported for the same command on each queue:
+# the first block uses 'new', the second 'new ring'
+option fail 0
+option malloc 0
+new
+time it RAND 50000
+time ih RAND 50000
+time reverse
+time swap
+time reverseK 4
+time sort
+time rhb 100000
+time rtb 100000
+free
+new ring
+time it RAND 50000
+time ih RAND 50000
+time reverse
+time swap
+time reverseK 4
+time sort
+time rhb 100000
+time rtb 100000
+free
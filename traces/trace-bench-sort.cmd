@@ -0,0 +1,47 @@
+# Benchmark of 'q_sort' algorithms on random, sorted and reversed input
+# Compare the 'Delta time' reported for each 'option sortmode' setting:
+# 0 picks by queue length, 1 is list_sort, 2 is the array-assisted sort,
+# 3 is the MSD radix sort, 4 is the adaptive natural merge sort.
+# The array sort only takes queues of up to 4096 elements and falls back to
+# list_sort beyond, so it is timed against list_sort again on a short queue
+option fail 0
+option malloc 0
+new
+ih RAND 100000
+option sortmode 1
+shuffle
+time sort
+time sort
+reverse
+time sort
+option sortmode 2
+shuffle
+time sort
+time sort
+reverse
+time sort
+option sortmode 3
+shuffle
+time sort
+time sort
+reverse
+time sort
+option sortmode 4
+shuffle
+time sort
+time sort
+reverse
+time sort
+option sortmode 0
+shuffle
+time sort
+free
+new
+ih RAND 4096
+option sortmode 1
+shuffle
+time sort
+option sortmode 2
+shuffle
+time sort
+free
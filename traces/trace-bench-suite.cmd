@@ -0,0 +1,9 @@
+# Microbenchmarks of every queue operation with the bench command
+# Each operation runs on 10000 random strings of each queue kind; compare
+# ns/op and elements/s across kinds, or save them as a baseline with
+# 'bench save FILE' and check a later build with 'bench compare FILE'
+option fail 0
+option malloc 0
+bench all 10000 list
+bench all 10000 ring
+bench all 10000 unrolled
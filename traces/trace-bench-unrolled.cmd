@@ -0,0 +1,28 @@
+# Benchmark of an unrolled queue against a list queue
+# Compare the 'Delta time' reported for the same command on each queue:
+# the first block uses 'new', the second 'new unrolled'
+# Insertion, removal, ascend, descend and shuffle work on the chunks; the
+# other commands go through the list view of the queue.  qtest walks
+# the list view after each insertion, which keeps it threaded, so the
+# insertions write both the chunk slot and the element's list node, and an
+# unrolled queue takes a pointer per element more than a list queue
+option fail 0
+option malloc 0
+new
+time it RAND 50000
+time ih RAND 50000
+sort
+time ascend
+time ascend
+time descend
+time rhb 100000
+free
+new unrolled
+time it RAND 50000
+time ih RAND 50000
+sort
+time ascend
+time ascend
+time descend
+time rhb 100000
+free